@@ -0,0 +1,887 @@
+//
+//  Bytecode.cpp
+//  scripting
+//
+//  Created by Vassili Kaplan on 17/10/26.
+//  Copyright © 2026 Vassili Kaplan. All rights reserved.
+//
+
+#include <cmath>
+#include <ctype.h>
+#include <stdlib.h>
+
+#include "Bytecode.h"
+#include "Functions.h"
+#include "ParserFunction.h"
+#include "Utils.h"
+
+unordered_map<int, Bytecode::Builtin> Bytecode::s_pureFunctions;
+
+void Bytecode::addPureFunction(const string& name, int argsNumber,
+                               PureFunction compute)
+{
+  if (argsNumber > MAX_PURE_ARGS) {
+    throw ParsingException("Too many arguments of [" + name + "]");
+  }
+  Builtin builtin = { ParserFunction::getFunction(name), argsNumber, compute };
+  s_pureFunctions[Symbols::intern(name)] = builtin;
+}
+
+shared_ptr<Bytecode> Bytecode::compileExpression(const string& data, size_t from,
+                                                 char terminator,
+                                                 const LocalSlots* slots)
+{
+  shared_ptr<Bytecode> program = make_shared<Bytecode>();
+  program->m_slots = slots;
+  size_t pos = from;
+  int result = program->m_registers++;
+
+  if (!program->compileList(data, pos, terminator, result)) {
+    return nullptr;
+  }
+
+  program->emit(RETURN, result);
+  program->removeUnusedLoads();
+  program->m_end = pos;
+  return program;
+}
+
+shared_ptr<Bytecode> Bytecode::compileStatement(const string& data, size_t from,
+                                                const LocalSlots* slots)
+{
+  shared_ptr<Bytecode> program = make_shared<Bytecode>();
+  program->m_slots = slots;
+  size_t pos = from;
+  int value = program->m_registers++;
+
+  bool prefix = data.compare(pos, 2, Constants::INCREMENT) == 0 ||
+                data.compare(pos, 2, Constants::DECREMENT) == 0;
+  Constants::Operator op = data[pos] == '+' ? Constants::PLUS : Constants::MINUS;
+  if (prefix) {
+    pos += 2;
+  }
+
+  string name = readName(data, pos);
+  if (name.empty()) {
+    return nullptr;
+  }
+  int nameIndex = program->addName(name);
+
+  if (prefix) { // ++i: the result is the new value.
+    if (pos >= data.size() || data[pos] != Constants::END_STATEMENT) {
+      return nullptr;
+    }
+    program->m_consts.push_back(1);
+    program->emit(LOAD_CONST, value, 0);
+    program->emit(STORE, nameIndex, value, op);
+    program->emit(RETURN, value);
+    program->m_end = pos;
+    return program;
+  }
+
+  bool postfix = data.compare(pos, 2, Constants::INCREMENT) == 0 ||
+                 data.compare(pos, 2, Constants::DECREMENT) == 0;
+  if (postfix) { // i++: the result is the old value.
+    op = data[pos] == '+' ? Constants::PLUS : Constants::MINUS;
+    pos += 2;
+    if (pos >= data.size() || data[pos] != Constants::END_STATEMENT) {
+      return nullptr;
+    }
+    int oldValue = program->m_registers++;
+    program->m_consts.push_back(1);
+    program->emit(LOAD_VAR, oldValue, nameIndex);
+    program->emit(LOAD_CONST, value, 0);
+    program->emit(STORE, nameIndex, value, op);
+    program->emit(RETURN, oldValue);
+    program->m_end = pos;
+    return program;
+  }
+
+  // Either "x = expr;" or "x op= expr;".
+  if (data.compare(pos, 1, Constants::ASSIGN) == 0 &&
+      data.compare(pos, 2, "==") != 0) {
+    op = Constants::NULL_OPERATOR;
+    pos++;
+  } else {
+    static const string operators = "+-*/%^";
+    static const Constants::Operator operations[] = {
+      Constants::PLUS, Constants::MINUS, Constants::MULTIPLY,
+      Constants::DIVIDE, Constants::MODULO, Constants::POWER };
+    size_t index = pos < data.size() ? operators.find(data[pos]) : string::npos;
+    if (index == string::npos ||
+        data.compare(pos + 1, 1, Constants::ASSIGN) != 0) {
+      return nullptr;
+    }
+    op = operations[index];
+    pos += 2;
+  }
+
+  if (!program->compileList(data, pos, Constants::END_STATEMENT, value)) {
+    return nullptr;
+  }
+
+  program->emit(STORE, nameIndex, value, op);
+  program->emit(RETURN, value);
+  program->removeUnusedLoads();
+  program->m_end = pos - 1; // the statement ends at the terminator
+  return program;
+}
+
+bool Bytecode::compileList(const string& data, size_t& pos, char terminator, int target)
+{
+  // Same as the Parser::split(): a list of operands with operations
+  // between them, e.g. "a + b * c".
+  vector<int> regs;
+  vector<Constants::Operator> ops;
+
+  // If an operand followed by "&&" is false or an operand followed by "||"
+  // is true, the Parser skips the rest of the expression and merges only
+  // the operands up to this one. These are the jumps to such merges.
+  vector<pair<int, size_t>> shortCircuits;
+
+  while (true) {
+    int reg = m_registers++;
+    if (!compileOperand(data, pos, reg) || pos >= data.size()) {
+      return false;
+    }
+    regs.push_back(reg);
+
+    if (data[pos] == terminator) {
+      pos++;
+      ops.push_back(Constants::NULL_OPERATOR);
+      break;
+    }
+
+    Constants::Operator op = readOperation(data, pos);
+    if (op == Constants::NULL_OPERATOR) {
+      return false;
+    }
+    ops.push_back(op);
+
+    if (op == Constants::AND || op == Constants::OR) {
+      int jump = emit(op == Constants::AND ? JUMP_IF_ZERO : JUMP_IF_NOT_ZERO, reg);
+      shortCircuits.emplace_back(jump, regs.size());
+    }
+  }
+
+  vector<int> jumpsToEnd;
+  compileMerge(regs, ops, regs.size(), target);
+  jumpsToEnd.push_back(emit(JUMP));
+
+  for (size_t i = 0; i < shortCircuits.size(); i++) {
+    m_code[shortCircuits[i].first].b = (int)m_code.size();
+    size_t count = shortCircuits[i].second;
+    vector<Constants::Operator> shortOps(ops.begin(), ops.begin() + count);
+    shortOps.back() = Constants::NULL_OPERATOR;
+    compileMerge(regs, shortOps, count, target);
+    jumpsToEnd.push_back(emit(JUMP));
+  }
+
+  for (size_t i = 0; i < jumpsToEnd.size(); i++) {
+    m_code[jumpsToEnd[i]].a = (int)m_code.size();
+  }
+  return true;
+}
+
+bool Bytecode::compileOperand(const string& data, size_t& pos, int target)
+{
+  if (pos >= data.size()) {
+    return false;
+  }
+
+  char ch = data[pos];
+  if (ch == Constants::START_ARG) {
+    pos++;
+    return compileList(data, pos, Constants::END_ARG, target);
+  }
+
+  if (isNumber(data.c_str() + pos)) {
+    const char* start = data.c_str() + pos;
+    char* end = nullptr;
+    double num = ::strtod(start, &end);
+    if (end == start) {
+      return false;
+    }
+    pos += end - start;
+    emit(LOAD_CONST, target, addConst(num));
+    return true;
+  }
+
+  string name = readName(data, pos);
+  if (name.empty()) {
+    return false;
+  }
+  
+  bool isCall = pos < data.size() && data[pos] == Constants::START_ARG;
+  
+  // The arguments of an inlined function hide everything else.
+  if (m_scope != nullptr && !isCall) {
+    const vector<string>& args = m_scope->function->getArgs();
+    if (find(args.begin(), args.end(), name) != args.end()) {
+      compileScopeName(name, target);
+      return true;
+    }
+  }
+  
+  // A call of a pure function, unless it's a variable with the same name.
+  auto it = s_pureFunctions.find(Symbols::find(name));
+  if (it != s_pureFunctions.end() && (it->second.argsNumber == 0 || isCall)) {
+    return compileCall(name, it->second, data, pos, target);
+  }
+  
+  if (isCall) {
+    return compileInline(name, data, pos, target);
+  }
+  
+  if (m_scope != nullptr) {
+    compileScopeName(name, target);
+    return true;
+  }
+  emit(LOAD_VAR, target, addName(name));
+  return true;
+}
+
+bool Bytecode::compileInline(const string& name, const string& data,
+                             size_t& pos, int target)
+{
+  const CustomFunction* function =
+    dynamic_cast<CustomFunction*>(ParserFunction::getFunction(name));
+  size_t from = 0;
+  if (function == nullptr || !function->isReturnExpression(MAX_INLINE_SIZE, from)) {
+    return false;
+  }
+  
+  // No recursion, either direct or through other functions.
+  int depth = 0;
+  for (const InlineScope* scope = m_scope; scope != nullptr; scope = scope->parent) {
+    if (scope->function == function || ++depth >= MAX_INLINE_DEPTH) {
+      return false;
+    }
+  }
+  
+  // The arguments, same as the Utils::getArgs() in the CustomFunction.
+  InlineScope scope = { function, vector<int>(), m_scope };
+  size_t argsNumber = function->getArgs().size();
+  pos++; // skip the opening parenthesis
+  if (argsNumber == 0) {
+    if (pos >= data.size() || data[pos] != Constants::END_ARG) {
+      return false;
+    }
+    pos++;
+  }
+  for (size_t i = 0; i < argsNumber; i++) {
+    char terminator = i + 1 < argsNumber ? Constants::NEXT_ARG : Constants::END_ARG;
+    int reg = m_registers++;
+    if (!compileList(data, pos, terminator, reg)) {
+      return false;
+    }
+    scope.args.push_back(reg);
+  }
+  
+  Inlined inlined = { Symbols::intern(name), function->getSource() };
+  m_inlined.push_back(inlined);
+  emit(CHECK_INLINED, 0, (int)m_inlined.size() - 1);
+  
+  m_scope = &scope;
+  bool compiled = compileList(inlined.body->data, from,
+                              Constants::END_STATEMENT, target);
+  m_scope = scope.parent;
+  return compiled;
+}
+
+void Bytecode::compileScopeName(const string& name, int target)
+{
+  const vector<string>& args = m_scope->function->getArgs();
+  size_t index = find(args.begin(), args.end(), name) - args.begin();
+  if (index == args.size()) {
+    // The functions see only their own locals and the globals.
+    emit(LOAD_GLOBAL, target, addName(name));
+    return;
+  }
+  
+  int reg = m_scope->args[index];
+  double value = 0;
+  if (isConstant(reg, value)) {
+    emit(LOAD_CONST, target, addConst(value));
+  } else {
+    emit(MOVE, target, reg);
+  }
+}
+
+bool Bytecode::compileCall(const string& name, const Builtin& function,
+                           const string& data, size_t& pos, int target)
+{
+  Call call;
+  call.symbol = Symbols::intern(name);
+  call.function = &function;
+  
+  if (function.argsNumber > 0) {
+    pos++; // skip the opening parenthesis
+  }
+  if (function.compute == nullptr) { // size(name)
+    string varName = readName(data, pos);
+    if (varName.empty() || pos >= data.size() || data[pos] != Constants::END_ARG) {
+      return false;
+    }
+    pos++;
+    call.name = addName(varName);
+  }
+  for (int i = 0; function.compute != nullptr && i < function.argsNumber; i++) {
+    // Same separators as the functions use, e.g. PowFunction.
+    char terminator = i + 1 < function.argsNumber ? Constants::NEXT_ARG :
+                                                    Constants::END_ARG;
+    int reg = m_registers++;
+    if (!compileList(data, pos, terminator, reg)) {
+      return false;
+    }
+    call.args.push_back(reg);
+  }
+  
+  m_calls.push_back(call);
+  int index = (int)m_calls.size() - 1;
+  
+  // With constant arguments the call is done now. It's only checked at run
+  // time that the function wasn't redefined in the meantime.
+  double args[MAX_PURE_ARGS];
+  bool isConst = function.compute != nullptr;
+  for (size_t i = 0; isConst && i < call.args.size(); i++) {
+    isConst = isConstant(call.args[i], args[i]);
+  }
+  if (isConst) {
+    emit(CHECK, 0, index);
+    emit(LOAD_CONST, target, addConst(function.compute(args)));
+    return true;
+  }
+  
+  emit(CALL, target, index);
+  return true;
+}
+
+void Bytecode::compileMerge(const vector<int>& regs, const vector<Constants::Operator>& ops,
+                            size_t count, int target)
+{
+  // Same priorities as in the Parser::merge(), with the operations of the
+  // same priority merged from left to right.
+  //
+  // The constants are pushed only when needed: the operations on two
+  // constants are done right away and only their result is kept.
+  // The operands from pushed on are the constants not pushed yet.
+  vector<double> operands;
+  size_t pushed = 0;
+  auto pushConstants = [&]() {
+    for (; pushed < operands.size(); pushed++) {
+      emit(PUSH_CONST, addConst(operands[pushed]));
+    }
+  };
+  auto push = [&](int reg) {
+    double value = 0;
+    if (isConstant(reg, value)) {
+      operands.push_back(value);
+      return;
+    }
+    pushConstants();
+    emit(PUSH, reg);
+    operands.push_back(value);
+    pushed = operands.size();
+  };
+  auto merge = [&](Constants::Operator op) {
+    double right = operands.back();
+    // An integer division by zero isn't done here, but where the
+    // Parser would do it, if at all.
+    bool canFold = operands.size() >= pushed + 2 &&
+                   (op != Constants::MODULO || (int)right != 0);
+    if (canFold) {
+      operands.pop_back();
+      operands.back() = Variable::mergeNumbers(operands.back(), right, op);
+      return;
+    }
+    pushConstants();
+    emit(BINARY, 0, 0, op);
+    operands.pop_back();
+    pushed = operands.size();
+  };
+  
+  vector<Constants::Operator> pending;
+  push(regs[0]);
+
+  for (size_t i = 0; i + 1 < count; i++) {
+    Constants::Operator op = ops[i];
+    while (!pending.empty() &&
+           Constants::getPriority(pending.back()) >= Constants::getPriority(op)) {
+      merge(pending.back());
+      pending.pop_back();
+    }
+    pending.push_back(op);
+    push(regs[i + 1]);
+  }
+
+  while (!pending.empty()) {
+    merge(pending.back());
+    pending.pop_back();
+  }
+  
+  if (pushed == 0) { // the whole expression is constant
+    emit(LOAD_CONST, target, addConst(operands[0]));
+  } else {
+    emit(POP, target);
+  }
+}
+
+bool Bytecode::isConstant(int reg, double& value) const
+{
+  // The registers of the operands are written once, except for the results
+  // of the expressions with "&&" or "||": those are written on every path.
+  int writes = 0;
+  for (size_t i = 0; i < m_code.size(); i++) {
+    const Instruction& instr = m_code[i];
+    bool writesReg = (instr.code == LOAD_CONST || instr.code == LOAD_VAR ||
+                      instr.code == POP || instr.code == CALL ||
+                      instr.code == MOVE || instr.code == LOAD_GLOBAL) &&
+                     instr.a == reg;
+    if (!writesReg) {
+      writesReg = instr.code == STORE && instr.b == reg;
+    }
+    if (writesReg && (++writes > 1 || instr.code != LOAD_CONST)) {
+      return false;
+    }
+    if (writesReg) {
+      value = m_consts[instr.b];
+    }
+  }
+  return writes == 1;
+}
+
+void Bytecode::removeUnusedLoads()
+{
+  vector<bool> used(m_registers, false);
+  for (size_t i = 0; i < m_code.size(); i++) {
+    const Instruction& instr = m_code[i];
+    switch (instr.code) {
+      case PUSH:
+      case JUMP_IF_ZERO:
+      case JUMP_IF_NOT_ZERO:
+      case RETURN:
+        used[instr.a] = true;
+        break;
+      case STORE:
+      case MOVE:
+        used[instr.b] = true;
+        break;
+      case CALL:
+        for (size_t j = 0; j < m_calls[instr.b].args.size(); j++) {
+          used[m_calls[instr.b].args[j]] = true;
+        }
+        break;
+      default:
+        break;
+    }
+  }
+  
+  // The new position of each instruction, and of the end, for the jumps.
+  vector<int> newPos(m_code.size() + 1);
+  size_t kept = 0;
+  for (size_t i = 0; i < m_code.size(); i++) {
+    newPos[i] = (int)kept;
+    if (m_code[i].code != LOAD_CONST || used[m_code[i].a]) {
+      m_code[kept++] = m_code[i];
+    }
+  }
+  newPos[m_code.size()] = (int)kept;
+  m_code.resize(kept);
+  
+  for (size_t i = 0; i < m_code.size(); i++) {
+    Instruction& instr = m_code[i];
+    if (instr.code == JUMP) {
+      instr.a = newPos[instr.a];
+    } else if (instr.code == JUMP_IF_ZERO || instr.code == JUMP_IF_NOT_ZERO) {
+      instr.b = newPos[instr.b];
+    }
+  }
+}
+
+Constants::Operator Bytecode::readOperation(const string& data, size_t& pos)
+{
+  // The longest action wins, e.g. "<=" and not "<".
+  size_t size = 2;
+  Constants::Operator op = Constants::toOperator(data.substr(pos, size));
+  if (op == Constants::NULL_OPERATOR) {
+    size = 1;
+    op = Constants::toOperator(data.substr(pos, size));
+  }
+
+  // Increments and assignments can't be a part of an expression.
+  int priority = Constants::getPriority(op);
+  if (priority < Constants::getPriority(Constants::OR) ||
+      priority > Constants::getPriority(Constants::POWER)) {
+    return Constants::NULL_OPERATOR;
+  }
+  pos += size;
+  return op;
+}
+
+bool Bytecode::isNumber(const char* str)
+{
+  char ch = str[0];
+  char next = ch == Constants::NULL_CHAR ? Constants::NULL_CHAR : str[1];
+  return isdigit(ch) || ch == '.' ||
+         (ch == '-' && (isdigit(next) || next == '.'));
+}
+
+string Bytecode::readName(const string& data, size_t& pos)
+{
+  size_t start = pos;
+  if (pos >= data.size() || (!isalpha(data[pos]) && data[pos] != '_')) {
+    return "";
+  }
+  while (pos < data.size() && (isalnum(data[pos]) || data[pos] == '_')) {
+    pos++;
+  }
+  return data.substr(start, pos - start);
+}
+
+int Bytecode::emit(OpCode code, int a, int b, Constants::Operator op)
+{
+  Instruction instruction = { code, op, a, b };
+  m_code.push_back(instruction);
+  return (int)m_code.size() - 1;
+}
+
+int Bytecode::addConst(double value)
+{
+  m_consts.push_back(value);
+  return (int)m_consts.size() - 1;
+}
+
+int Bytecode::addName(const string& name)
+{
+  for (size_t i = 0; i < m_names.size(); i++) {
+    if (m_names[i] == name) {
+      return (int)i;
+    }
+  }
+  int symbol = Symbols::intern(name);
+  m_names.push_back(name);
+  m_nameSymbols.push_back(symbol);
+  m_nameSlots.push_back(m_slots != nullptr ? m_slots->find(symbol) : -1);
+  return (int)m_names.size() - 1;
+}
+
+GetVarFunction* Bytecode::getNumberVariable(int name) const
+{
+  return getNumberVariable(m_nameSymbols[name], m_nameSlots[name], m_slots);
+}
+
+GetVarFunction* Bytecode::getVariable(int name) const
+{
+  return getVariable(m_nameSymbols[name], m_nameSlots[name], m_slots);
+}
+
+GetVarFunction* Bytecode::getNumberVariable(int symbol, int slot,
+                                            const LocalSlots* slots)
+{
+  GetVarFunction* var = getVariable(symbol, slot, slots);
+  if (var == nullptr || var->getValue().type != Constants::NUMBER) {
+    return nullptr;
+  }
+  return var;
+}
+
+GetVarFunction* Bytecode::getVariable(int symbol, int slot,
+                                      const LocalSlots* slots)
+{
+  ParserFunction* func = slot >= 0 ?
+    ParserFunction::getLocalVariable(slots, slot) : nullptr;
+  if (func == nullptr) {
+    func = ParserFunction::getFunction(symbol);
+  }
+  return dynamic_cast<GetVarFunction*>(func);
+}
+
+bool Bytecode::isBuiltin(const Call& call) const
+{
+  return ParserFunction::getFunction(call.symbol) == call.function->impl;
+}
+
+bool Bytecode::isInlined(const Inlined& inlined) const
+{
+  // A redefined function gets a new body even if it's at the same address.
+  CustomFunction* function =
+    dynamic_cast<CustomFunction*>(ParserFunction::getFunction(inlined.symbol));
+  return function != nullptr && function->getSource() == inlined.body;
+}
+
+void Bytecode::assignVariable(int name, double value) const
+{
+  // Same as GetVarFunction::setVariable(), by slot if possible.
+  int slot = m_nameSlots[name];
+  ParserFunction* func = slot >= 0 ?
+    ParserFunction::getLocalVariable(m_slots, slot) : nullptr;
+  if (func == nullptr) {
+    func = ParserFunction::getVariable(m_nameSymbols[name]);
+  }
+  
+  GetVarFunction* var = dynamic_cast<GetVarFunction*>(func);
+  if (var != nullptr) {
+    var->updateValue() = Variable(value);
+    return;
+  }
+  
+  var = new GetVarFunction(Variable(value));
+  if (slot < 0 || !ParserFunction::setLocalVariable(m_slots, slot, var)) {
+    ParserFunction::addGlobalOrLocalVariable(m_names[name], var);
+  }
+}
+
+Bytecode::Scratch& Bytecode::getScratch()
+{
+  static thread_local Scratch scratch;
+  return scratch;
+}
+
+bool Bytecode::run(Variable& result) const
+{
+  // A run never starts another one, it only calls the pure builtins,
+  // so the buffers of the thread are free.
+  Scratch& scratch = getScratch();
+  vector<double>& regs = scratch.regs;
+  vector<double>& stack = scratch.stack;
+  regs.assign(m_registers, 0.0);
+  stack.clear();
+
+  for (size_t pc = 0; pc < m_code.size(); ) {
+    const Instruction& instr = m_code[pc++];
+    switch (instr.code) {
+      case LOAD_CONST:
+        regs[instr.a] = m_consts[instr.b];
+        break;
+      case LOAD_VAR: {
+        GetVarFunction* var = getNumberVariable(instr.b);
+        if (var == nullptr) {
+          return false;
+        }
+        regs[instr.a] = var->getValue().numValue;
+        break;
+      }
+      case JUMP:
+        pc = instr.a;
+        break;
+      case JUMP_IF_ZERO:
+        if (regs[instr.a] == 0) {
+          pc = instr.b;
+        }
+        break;
+      case JUMP_IF_NOT_ZERO:
+        if (regs[instr.a] != 0) {
+          pc = instr.b;
+        }
+        break;
+      case PUSH:
+        stack.push_back(regs[instr.a]);
+        break;
+      case BINARY: {
+        double right = stack.back();
+        stack.pop_back();
+        stack.back() = Variable::mergeNumbers(stack.back(), right, instr.op);
+        break;
+      }
+      case POP:
+        regs[instr.a] = stack.back();
+        stack.pop_back();
+        break;
+      case STORE: {
+        // Same as the AssignFunction, IncrDecrFunction and the
+        // OperatorAssignFunction. Always the last change to be made.
+        if (instr.op == Constants::NULL_OPERATOR) {
+          assignVariable(instr.a, regs[instr.b]);
+          break;
+        }
+        GetVarFunction* var = getNumberVariable(instr.a);
+        if (var == nullptr) {
+          return false;
+        }
+        Variable& current = var->updateValue();
+        current.numValue = Variable::mergeNumbers(current.numValue, regs[instr.b], instr.op);
+        regs[instr.b] = current.numValue;
+        break;
+      }
+      case PUSH_CONST:
+        stack.push_back(m_consts[instr.a]);
+        break;
+      case CALL: {
+        const Call& call = m_calls[instr.b];
+        if (!isBuiltin(call)) {
+          return false;
+        }
+        if (call.function->compute == nullptr) {
+          // Same as the SizeFunction.
+          GetVarFunction* var = getVariable(call.name);
+          if (var == nullptr) {
+            return false;
+          }
+          const Variable& value = var->getValue();
+          regs[instr.a] = value.type == Constants::ARRAY ?
+                          value.getTuple().size() : value.toString().size();
+          break;
+        }
+        double args[MAX_PURE_ARGS];
+        for (size_t i = 0; i < call.args.size(); i++) {
+          args[i] = regs[call.args[i]];
+        }
+        regs[instr.a] = call.function->compute(args);
+        break;
+      }
+      case CHECK:
+        if (!isBuiltin(m_calls[instr.b])) {
+          return false;
+        }
+        break;
+      case MOVE:
+        regs[instr.a] = regs[instr.b];
+        break;
+      case LOAD_GLOBAL: {
+        GetVarFunction* var = dynamic_cast<GetVarFunction*>(
+          ParserFunction::getVariable(m_nameSymbols[instr.b], true /* onlyGlobal */));
+        if (var == nullptr || var->getValue().type != Constants::NUMBER) {
+          return false;
+        }
+        regs[instr.a] = var->getValue().numValue;
+        break;
+      }
+      case CHECK_INLINED:
+        if (!isInlined(m_inlined[instr.b])) {
+          return false;
+        }
+        break;
+      case RETURN:
+        result = Variable(regs[instr.a]);
+        return true;
+    }
+  }
+  return false;
+}
+
+//-------------------------------------------
+shared_ptr<ForLoop> ForLoop::compile(const string& header,
+                                     const shared_ptr<const LocalSlots>& slots)
+{
+  vector<string> forTokens = Utils::tokenize(header, string(1, Constants::END_STATEMENT));
+  if (forTokens.size() != 3) {
+    throw ParsingException("Expecting: for(init; condition; loopStatement)");
+  }
+  
+  shared_ptr<ForLoop> loop = make_shared<ForLoop>();
+  loop->m_slots = slots.get();
+  for (int i = 0; i < 3; i++) {
+    shared_ptr<ScriptSource> source = make_shared<ScriptSource>();
+    source->data = forTokens[i] + Constants::END_STATEMENT;
+    loop->m_sources[i] = source;
+    loop->m_caches[i] = make_shared<ScriptCache>();
+    loop->m_caches[i]->setSlots(slots);
+  }
+  
+  loop->m_counting = loop->compileCounting(forTokens[CONDITION], forTokens[STEP]);
+  return loop;
+}
+
+bool ForLoop::compileCounting(const string& condition, const string& step)
+{
+  // The condition: "i < n", "i <= 10", etc. Not "!=": the Parser doesn't
+  // take it as a comparison in the middle of an expression.
+  size_t pos = 0;
+  m_counter = Bytecode::readName(condition, pos);
+  if (m_counter.empty()) {
+    return false;
+  }
+  m_compare = Bytecode::readOperation(condition, pos);
+  if (m_compare < Constants::LESS || m_compare > Constants::EQUAL) {
+    return false;
+  }
+  
+  const char* start = condition.c_str() + pos;
+  char* end = nullptr;
+  if (Bytecode::isNumber(start)) {
+    m_limitValue = ::strtod(start, &end);
+    pos += end - start;
+  } else {
+    m_limit = Bytecode::readName(condition, pos);
+    if (m_limit.empty()) {
+      return false;
+    }
+  }
+  if (pos != condition.size()) {
+    return false;
+  }
+  
+  // The step: "i++", "++i", "i--", "--i", "i += 2" or "i -= 2".
+  if (step == m_counter + Constants::INCREMENT ||
+      step == Constants::INCREMENT + m_counter) {
+    m_delta = 1;
+  } else if (step == m_counter + Constants::DECREMENT ||
+             step == Constants::DECREMENT + m_counter) {
+    m_delta = -1;
+  } else if (Utils::startsWith(step, m_counter) &&
+             step.size() > m_counter.size() + 2 &&
+             (step[m_counter.size()] == '+' || step[m_counter.size()] == '-') &&
+             step[m_counter.size() + 1] == Constants::ASSIGN[0]) {
+    start = step.c_str() + m_counter.size() + 2;
+    if (!Bytecode::isNumber(start)) {
+      return false;
+    }
+    m_delta = ::strtod(start, &end);
+    if (end != step.c_str() + step.size()) {
+      return false;
+    }
+    m_delta = step[m_counter.size()] == '+' ? m_delta : -m_delta;
+  } else {
+    return false;
+  }
+  
+  m_counterSymbol = Symbols::intern(m_counter);
+  m_limitSymbol = m_limit.empty() ? Symbols::NONE : Symbols::intern(m_limit);
+  m_counterSlot = m_slots != nullptr ? m_slots->find(m_counterSymbol) : -1;
+  m_limitSlot = m_slots != nullptr && !m_limit.empty() ? m_slots->find(m_limitSymbol) : -1;
+  return true;
+}
+
+ParsingScript ForLoop::getScript(Part part) const
+{
+  ParsingScript script(m_sources[part]);
+  script.setCache(m_caches[part]);
+  return script;
+}
+
+bool ForLoop::checkCondition(bool& isTrue) const
+{
+  if (!m_counting) {
+    return false;
+  }
+  GetVarFunction* counter = Bytecode::getNumberVariable(m_counterSymbol, m_counterSlot, m_slots);
+  if (counter == nullptr) {
+    return false;
+  }
+  
+  double limit = m_limitValue;
+  if (!m_limit.empty()) {
+    GetVarFunction* var = Bytecode::getNumberVariable(m_limitSymbol, m_limitSlot, m_slots);
+    if (var == nullptr) {
+      return false;
+    }
+    limit = var->getValue().numValue;
+  }
+  
+  isTrue = Variable::mergeNumbers(counter->getValue().numValue, limit, m_compare) != 0;
+  return true;
+}
+
+bool ForLoop::step() const
+{
+  if (!m_counting) {
+    return false;
+  }
+  GetVarFunction* counter = Bytecode::getNumberVariable(m_counterSymbol, m_counterSlot, m_slots);
+  if (counter == nullptr) {
+    return false;
+  }
+  counter->updateValue().numValue += m_delta;
+  return true;
+}
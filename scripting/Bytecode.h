@@ -0,0 +1,242 @@
+//
+//  Bytecode.h
+//  scripting
+//
+//  Created by Vassili Kaplan on 17/10/26.
+//  Copyright © 2026 Vassili Kaplan. All rights reserved.
+//
+
+#ifndef Bytecode_h
+#define Bytecode_h
+
+#include "Constants.h"
+#include "ParsingScript.h"
+#include "Variable.h"
+
+#include <memory>
+
+class CustomFunction;
+class GetVarFunction;
+class ParserFunction;
+
+// A compiled form of the numeric expressions and assignments: conditions of
+// if and while, for-loop headers and statements like "s += i * 2;".
+// A program is compiled once per script position and then executed by a
+// small register and stack machine instead of being parsed again.
+//
+// Anything else (strings, arrays, most function calls, etc.) is not compiled
+// and is left to the Parser. The same happens at run time if a variable
+// turns out not to be a number: run() returns false before changing
+// anything, so the caller can always fall back to the Parser.
+//
+// The calls of the builtin functions without side effects (see
+// addPureFunction()) are compiled as well. The operations and calls with
+// constant operands are done once, when compiling, e.g. "2 * pi" is loaded
+// as a single constant.
+//
+// So are the calls of the small custom functions that just return an
+// expression, e.g. "function sq(x) { return x * x; }": the expression is
+// inlined with the arguments in registers. If the function is redefined,
+// the program fails and the Parser calls the function instead.
+class Bytecode
+{
+public:
+  
+  // A builtin function of numbers, e.g. sqrt. Null for size(),
+  // the only other pure function: it takes a variable name.
+  typedef double (*PureFunction)(const double* args);
+  static const int MAX_PURE_ARGS = 2;
+  
+  // Called after the function is registered, see Interpreter::init().
+  static void addPureFunction(const string& name, int argsNumber,
+                              PureFunction compute);
+
+  enum OpCode : unsigned char {
+    LOAD_CONST,       // regs[a] = consts[b]
+    LOAD_VAR,         // regs[a] = value of the variable names[b]
+    JUMP,             // go to a
+    JUMP_IF_ZERO,     // go to b if regs[a] == 0
+    JUMP_IF_NOT_ZERO, // go to b if regs[a] != 0
+    PUSH,             // push regs[a]
+    BINARY,           // pop right and left, push left (op) right
+    POP,              // regs[a] = pop
+    STORE,            // names[a] (op)= regs[b], plain assignment if no op
+    PUSH_CONST,       // push consts[a]
+    CALL,             // regs[a] = calls[b]
+    CHECK,            // fail if calls[b] isn't the builtin any more
+    MOVE,             // regs[a] = regs[b]
+    LOAD_GLOBAL,      // regs[a] = value of the global variable names[b]
+    CHECK_INLINED,    // fail if inlined[b] was redefined
+    RETURN            // the result is regs[a]
+  };
+
+  struct Instruction
+  {
+    OpCode              code;
+    Constants::Operator op;
+    int                 a;
+    int                 b;
+  };
+
+  // Compiles an expression starting at from and ending with the terminator,
+  // e.g. the condition of an if or of a while ending with ')'.
+  // If slots are given, the variables are looked up by their local slots.
+  static shared_ptr<Bytecode> compileExpression(const string& data, size_t from,
+                                                char terminator,
+                                                const LocalSlots* slots = nullptr);
+  // Compiles an assignment ending with ';', e.g. "i++;" or "x = a * b;".
+  static shared_ptr<Bytecode> compileStatement(const string& data, size_t from,
+                                               const LocalSlots* slots = nullptr);
+
+  // Returns false if the program couldn't be executed.
+  bool run(Variable& result) const;
+  
+  // The variable with the given interned name (found by its slot if there
+  // is one), null if there is no such variable or if it isn't a number.
+  static GetVarFunction* getNumberVariable(int symbol, int slot,
+                                           const LocalSlots* slots);
+  // Same, but the variable can be of any type.
+  static GetVarFunction* getVariable(int symbol, int slot,
+                                     const LocalSlots* slots);
+
+  // Script pointer after the compiled code.
+  size_t getEnd() const { return m_end; }
+
+private:
+
+  struct Builtin
+  {
+    ParserFunction* impl; // as registered, to check it wasn't redefined
+    int             argsNumber;
+    PureFunction    compute;
+  };
+  
+  struct Call
+  {
+    int            symbol;
+    const Builtin* function;
+    vector<int>    args; // registers
+    int            name = -1; // the argument of size()
+  };
+  
+  struct Inlined
+  {
+    int                            symbol;
+    shared_ptr<const ScriptSource> body; // also keeps its address unique
+  };
+  
+  // A function whose expression is being compiled in place of its call.
+  struct InlineScope
+  {
+    const CustomFunction* function;
+    vector<int>           args; // registers of the arguments
+    const InlineScope*    parent;
+  };
+  
+  // Longest body of a function to inline, and how deep the inlined
+  // functions can call each other.
+  static const size_t MAX_INLINE_SIZE  = 256;
+  static const int    MAX_INLINE_DEPTH = 4;
+
+  bool compileList(const string& data, size_t& pos, char terminator, int target);
+  bool compileOperand(const string& data, size_t& pos, int target);
+  bool compileCall(const string& name, const Builtin& function,
+                   const string& data, size_t& pos, int target);
+  bool compileInline(const string& name, const string& data, size_t& pos, int target);
+  // Inside of an inlined function: its argument or a global variable.
+  void compileScopeName(const string& name, int target);
+  void compileMerge(const vector<int>& regs, const vector<Constants::Operator>& ops,
+                    size_t count, int target);
+  // Removes the loads of the constants that were folded into other ones.
+  void removeUnusedLoads();
+  
+  // Whether the register is only ever loaded with a constant.
+  bool isConstant(int reg, double& value) const;
+  bool isBuiltin(const Call& call) const;
+  bool isInlined(const Inlined& inlined) const;
+
+  friend class ForLoop;
+  static Constants::Operator readOperation(const string& data, size_t& pos);
+  static string readName(const string& data, size_t& pos);
+  // Whether a number literal starts here.
+  static bool isNumber(const char* str);
+
+  // The registers and the operand stack of run(), kept between the runs
+  // of the thread so that they are allocated only once.
+  struct Scratch
+  {
+    vector<double> regs;
+    vector<double> stack;
+  };
+  static Scratch& getScratch();
+
+  GetVarFunction* getNumberVariable(int name) const;
+  GetVarFunction* getVariable(int name) const;
+  void assignVariable(int name, double value) const;
+
+  int emit(OpCode code, int a = 0, int b = 0, Constants::Operator op = Constants::NULL_OPERATOR);
+  int addName(const string& name);
+  int addConst(double value);
+
+  vector<Instruction> m_code;
+  vector<double>      m_consts;
+  vector<string>      m_names;
+  vector<int>         m_nameSymbols;
+  vector<int>         m_nameSlots; // -1 if the name has no slot
+  vector<Call>        m_calls;
+  vector<Inlined>     m_inlined;
+  const InlineScope*  m_scope = nullptr; // only while compiling
+  const LocalSlots*   m_slots = nullptr;
+  int                 m_registers = 0;
+  size_t              m_end = 0;
+  
+  static unordered_map<int, Builtin> s_pureFunctions; // by symbol
+};
+
+// The header of a canonical for-loop, "for (init; cond; step)", split once
+// per script position. Each of the three parts keeps its own cache, so it
+// is parsed only once as well.
+//
+// The usual counting header "i = 0; i < n; i++" is recognized too: its
+// condition and step are then done directly on the number stored in the
+// counter variable. If the counter or the limit turn out not to be numbers,
+// the caller falls back to the Parser, as with the Bytecode.
+class ForLoop
+{
+public:
+
+  enum Part { INIT, CONDITION, STEP };
+
+  // Throws if the header doesn't have three parts.
+  static shared_ptr<ForLoop> compile(const string& header,
+                                     const shared_ptr<const LocalSlots>& slots);
+
+  // A script to execute the given part of the header with the Parser.
+  ParsingScript getScript(Part part) const;
+
+  // Both return false if the Parser must be used instead.
+  bool checkCondition(bool& isTrue) const;
+  bool step() const;
+
+private:
+
+  bool compileCounting(const string& condition, const string& step);
+
+  shared_ptr<const ScriptSource> m_sources[3];
+  shared_ptr<ScriptCache>        m_caches[3];
+  const LocalSlots*              m_slots = nullptr;
+
+  // The counting loop: "counter compare limit" and "counter += delta".
+  bool                m_counting = false;
+  string              m_counter;
+  int                 m_counterSymbol = Symbols::NONE;
+  int                 m_counterSlot = -1;
+  Constants::Operator m_compare = Constants::NULL_OPERATOR;
+  string              m_limit;     // empty if the limit is a number
+  int                 m_limitSymbol = Symbols::NONE;
+  int                 m_limitSlot = -1;
+  double              m_limitValue = 0;
+  double              m_delta = 0;
+};
+
+#endif /* Bytecode_h */
@@ -39,6 +39,12 @@ const string Constants::FOR         = "for";
 const string Constants::FUNCTION    = "function";
 const string Constants::IF          = "if";
 const string Constants::INCLUDE     = "include";
+const string Constants::PARALLEL_FOR = "parallel_for";
+const string Constants::REDUCE      = "reduce";
+const string Constants::REDUCE_APPEND = "append";
+const string Constants::REDUCE_MAX  = "max";
+const string Constants::REDUCE_MIN  = "min";
+const string Constants::REDUCE_SUM  = "sum";
 const string Constants::RETURN      = "return";
 const string Constants::SIZE        = "size";
 const string Constants::TRY         = "try";
@@ -50,7 +56,12 @@ const string Constants::ADD         = "add";
 const string Constants::ALL         = "all";
 const string Constants::ALLVARS     = "allvars";
 const string Constants::APPENDLINE  = "appendline";
+const string Constants::ASYNC       = "async";
+const string Constants::AWAIT       = "await";
+const string Constants::AWAIT_ALL   = "await_all";
 const string Constants::CEIL        = "ceil";
+const string Constants::CHANNEL     = "channel";
+const string Constants::CLOSE       = "close";
 const string Constants::CONTAINS    = "contains";
 const string Constants::COS         = "cos";
 const string Constants::EXP         = "exp";
@@ -74,7 +85,11 @@ const string Constants::ROUND       = "round";
 const string Constants::READ        = "read";
 const string Constants::READFILE    = "readfile";
 const string Constants::READNUM     = "readnum";
+const string Constants::RECEIVE     = "receive";
+const string Constants::RECEIVE_TRY = "tryreceive";
 const string Constants::RUN         = "run";
+const string Constants::SEND        = "send";
+const string Constants::SEND_TRY    = "trysend";
 const string Constants::SHOW        = "show";
 const string Constants::SIGNAL      = "signal";
 const string Constants::SIN         = "sin";
@@ -149,37 +164,31 @@ vector<string> initActions()
 
 const vector<string> Constants::ACTIONS(initActions());
 
-unordered_map<string, int> initPriority()
+constexpr int Constants::OPERATOR_PRIORITY[];
+
+const string Constants::OPERATOR_STRINGS[] = {
+  NULL_ACTION,
+  "+", "-", "*", "/", "%", "^",
+  "<", ">", "<=", ">=", "==", "!=",
+  "&&", "||",
+  "++", "--",
+  "=", "+=", "-=", "*=", "/=",
+  "%=", "&=", "|=", "^="
+};
+
+Constants::Operator Constants::toOperator(const string& action)
 {
-    unordered_map<string, int> prio;
-    prio["++"] = 10;
-    prio["--"] = 10;
-    prio["^"]  = 9;
-    prio["%"]  = 8;
-    prio["*"]  = 8;
-    prio["/"]  = 8;
-    prio["+"]  = 7;
-    prio["-"]  = 7;
-    prio["<"]  = 6;
-    prio[">"]  = 6;
-    prio["<="] = 6;
-    prio[">="] = 6;
-    prio["=="] = 5;
-    prio["!="] = 5;
-    prio["&&"] = 4;
-    prio["||"] = 3;
-    prio["+="] = 2;
-    prio["-="] = 2;
-    prio["*="] = 2;
-    prio["/="] = 2;
-    prio["%="] = 2;
-    prio["="]  = 2;
-
-    return prio;
+  if (action.empty() || action.size() > 2) {
+    return NULL_OPERATOR;
+  }
+  for (int i = NULL_OPERATOR + 1; i < OPERATOR_COUNT; i++) {
+    if (OPERATOR_STRINGS[i] == action) {
+      return (Operator)i;
+    }
+  }
+  return NULL_OPERATOR;
 }
 
-const unordered_map<string, int> Constants::PRIORITY(initPriority());
-
 string Constants::typeToString(Type type)
 {
   switch (type) {
@@ -31,7 +31,38 @@ public:
     CONTINUE_STATEMENT
   };
   
+  // Actions between operands, parsed once from their string form,
+  // see toOperator(). NULL_OPERATOR stands for no action or for the
+  // end of an argument.
+  enum Operator {
+    NULL_OPERATOR,
+    PLUS, MINUS, MULTIPLY, DIVIDE, MODULO, POWER,
+    LESS, GREATER, LESS_EQUAL, GREATER_EQUAL, EQUAL, NOT_EQUAL,
+    AND, OR,
+    PLUS_PLUS, MINUS_MINUS,
+    ASSIGNMENT, PLUS_ASSIGN, MINUS_ASSIGN, MULTIPLY_ASSIGN, DIVIDE_ASSIGN,
+    MODULO_ASSIGN, AND_ASSIGN, OR_ASSIGN, POWER_ASSIGN,
+    OPERATOR_COUNT
+  };
+  
+  // Priorities of operators, indexed by Operator.
+  static constexpr int OPERATOR_PRIORITY[OPERATOR_COUNT] = {
+    0,
+    7, 7, 8, 8, 8, 9,
+    6, 6, 6, 6, 5, 5,
+    4, 3,
+    10, 10,
+    2, 2, 2, 2, 2,
+    2, 0, 0, 0
+  };
+  
   static const size_t MAX_LOOPS         = 100000;
+  static const size_t MAX_STACK_LEVELS  = 100000;  // nested calls, by default
+  static const size_t STACK_SIZE        = 1 << 30; // of the interpreter thread
+  static const size_t WORKER_STACK_SIZE = 1 << 26; // of a ThreadPool worker
+  // The stack a nested call may need. Used to lower the number of the
+  // nested calls if the stack of the thread is smaller.
+  static const size_t STACK_PER_LEVEL   = STACK_SIZE / MAX_STACK_LEVELS;
   static const size_t MAX_CHARS_TO_SHOW = 40;
   static const size_t MAX_TAIL_LINES    = 10;
   static const size_t MAX_VAR_SIZE      = 2048;
@@ -82,6 +113,12 @@ public:
   static const string FUNCTION;
   static const string IF;
   static const string INCLUDE;
+  static const string PARALLEL_FOR;
+  static const string REDUCE;
+  static const string REDUCE_APPEND;
+  static const string REDUCE_MAX;
+  static const string REDUCE_MIN;
+  static const string REDUCE_SUM;
   static const string RETURN;
   static const string SIZE;
   static const string THROW;
@@ -93,7 +130,12 @@ public:
   static const string ALL;
   static const string ALLVARS;
   static const string APPENDLINE;
+  static const string ASYNC;
+  static const string AWAIT;
+  static const string AWAIT_ALL;
   static const string CEIL;
+  static const string CHANNEL;
+  static const string CLOSE;
   static const string CONTAINS;
   static const string COS;
   static const string EXP;
@@ -117,7 +159,11 @@ public:
   static const string READ;
   static const string READFILE;
   static const string READNUM;
+  static const string RECEIVE;
+  static const string RECEIVE_TRY;
   static const string RUN;
+  static const string SEND;
+  static const string SEND_TRY;
   static const string SHOW;
   static const string SIN;
   static const string SLEEP;
@@ -169,7 +215,13 @@ public:
   
   static set<string> CONTROL_FLOW;
   
-  static const unordered_map<string, int> PRIORITY;
+  static const string OPERATOR_STRINGS[OPERATOR_COUNT];
+  
+  static Operator toOperator(const string& action);
+  static const string& operatorToString(Operator op) {
+    return OPERATOR_STRINGS[op];
+  }
+  static int getPriority(Operator op) { return OPERATOR_PRIORITY[op]; }
   
   static string language(const string& lang);
   
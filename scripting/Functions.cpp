@@ -24,7 +24,11 @@ bool SignalWaitFunction::g_signaled = false;
 mutex SignalWaitFunction::g_mutex;
 mutex LockFunction::g_mutex;
 condition_variable SignalWaitFunction::g_cv;
-unordered_map<string, thread*> ThreadFunction::g_threads;
+unordered_map<string, shared_ptr<Channel>> ChannelFunction::g_channels;
+mutex ChannelFunction::g_mutex;
+unordered_map<size_t, shared_ptr<Task>> ThreadFunction::g_threads;
+size_t ThreadFunction::g_lastThread = 0;
+mutex ThreadFunction::g_mutex;
 
 //-------------------------------------------
 Variable StringOrNumberFunction::evaluate(ParsingScript& script)
@@ -82,46 +86,76 @@ Variable AllVariables::evaluate(ParsingScript& script)
 }
 
 //-------------------------------------------
+double AbsFunction::compute(const double* args)
+{
+  return std::abs(args[0]);
+}
+
 Variable AbsFunction::evaluate(ParsingScript& script)
 {
   Variable arg = Parser::loadAndCalculate(script, Constants::END_ARG_STR);
   Utils::checkNumber(arg);
-  return std::abs(arg.numValue);
+  return compute(&arg.numValue);
 }
 //-------------------------------------------
+double SinFunction::compute(const double* args)
+{
+  return ::sin(args[0]);
+}
+
 Variable SinFunction::evaluate(ParsingScript& script)
 {
   Variable arg = Parser::loadAndCalculate(script, Constants::END_ARG_STR);
   Utils::checkNumber(arg);
-  return ::sin(arg.numValue);
+  return compute(&arg.numValue);
 }
 //-------------------------------------------
+double CeilFunction::compute(const double* args)
+{
+  return ::ceil(args[0]);
+}
+
 Variable CeilFunction::evaluate(ParsingScript& script)
 {
   Variable arg = Parser::loadAndCalculate(script, Constants::END_ARG_STR);
   Utils::checkNumber(arg);
-  return ::ceil(arg.numValue);
+  return compute(&arg.numValue);
 }
 //-------------------------------------------
+double CosFunction::compute(const double* args)
+{
+  return ::cos(args[0]);
+}
+
 Variable CosFunction::evaluate(ParsingScript& script)
 {
   Variable arg = Parser::loadAndCalculate(script, Constants::END_ARG_STR);
   Utils::checkNumber(arg);
-  return ::cos(arg.numValue);
+  return compute(&arg.numValue);
 }
 //-------------------------------------------
+double ExpFunction::compute(const double* args)
+{
+  return ::exp(args[0]);
+}
+
 Variable ExpFunction::evaluate(ParsingScript& script)
 {
   Variable arg = Parser::loadAndCalculate(script, Constants::END_ARG_STR);
   Utils::checkNumber(arg);
-  return ::exp(arg.numValue);
+  return compute(&arg.numValue);
 }
 //-------------------------------------------
+double FloorFunction::compute(const double* args)
+{
+  return ::floor(args[0]);
+}
+
 Variable FloorFunction::evaluate(ParsingScript& script)
 {
   Variable arg = Parser::loadAndCalculate(script, Constants::END_ARG_STR);
   Utils::checkNumber(arg);
-  return ::floor(arg.numValue);
+  return compute(&arg.numValue);
 }
 //-------------------------------------------
 Variable IndexOfFunction::evaluate(ParsingScript& script)
@@ -148,20 +182,35 @@ Variable IndexOfFunction::evaluate(ParsingScript& script)
   return Variable(result);
 }
 //-------------------------------------------
+double LogFunction::compute(const double* args)
+{
+  return ::log(args[0]);
+}
+
 Variable LogFunction::evaluate(ParsingScript& script)
 {
   Variable arg = Parser::loadAndCalculate(script, Constants::END_ARG_STR);
   Utils::checkNumber(arg);
-  return ::log(arg.numValue);
+  return compute(&arg.numValue);
 }
 
 //-------------------------------------------
-Variable PiFunction::evaluate(ParsingScript& script)
+double PiFunction::compute(const double*)
 {
   return 3.141592653589793;
 }
 
+Variable PiFunction::evaluate(ParsingScript& script)
+{
+  return compute(nullptr);
+}
+
 //-------------------------------------------
+double PowFunction::compute(const double* args)
+{
+  return ::pow(args[0], args[1]);
+}
+
 Variable PowFunction::evaluate(ParsingScript& script)
 {
   Variable arg1 = Parser::loadAndCalculate(script, Constants::FUNC_SIG_SEP);
@@ -170,22 +219,33 @@ Variable PowFunction::evaluate(ParsingScript& script)
   Variable arg2 = Parser::loadAndCalculate(script, Constants::FUNC_SIG_SEP);
   Utils::checkNumber(arg2);
   
-  arg1.numValue = ::pow(arg1.numValue, arg2.numValue);
+  double args[] = { arg1.numValue, arg2.numValue };
+  arg1.numValue = compute(args);
   return arg1;
 }
 //-------------------------------------------
+double RoundFunction::compute(const double* args)
+{
+  return ::floor(args[0] + 0.5);
+}
+
 Variable RoundFunction::evaluate(ParsingScript& script)
 {
   Variable arg = Parser::loadAndCalculate(script, Constants::END_ARG_STR);
   //Utils::checkNumber(arg);
-  return ::floor(arg.numValue + 0.5);
+  return compute(&arg.numValue);
 }
 //-------------------------------------------
+double SqrtFunction::compute(const double* args)
+{
+  return ::sqrt(args[0]);
+}
+
 Variable SqrtFunction::evaluate(ParsingScript& script)
 {
   Variable arg = Parser::loadAndCalculate(script, Constants::END_ARG_STR);
   Utils::checkNumber(arg);
-  return ::sqrt(arg.numValue);
+  return compute(&arg.numValue);
 }
 //-------------------------------------------
 Variable SubstrFunction::evaluate(ParsingScript& script)
@@ -238,19 +298,22 @@ Variable AddFunction::evaluate(ParsingScript& script)
   bool isGlobal = true;
   ParserFunction* func = ParserFunction::getFunction(varName, isGlobal);
   Utils::checkNotNull(varName, func);
-  Variable currentValue = func->getValue(script);
+  GetVarFunction* var = dynamic_cast<GetVarFunction*>(func);
+  Variable currentValue = var != 0 ? Variable::emptyInstance : func->getValue(script);
   
   // 3. Get the variable to add.
   Variable item = Utils::getItem(script);
   
-  // 4. Add it to the tuple.
-  currentValue.type = Constants::ARRAY;
-  currentValue.tuple.emplace_back(item);
+  // 4. Add it to the tuple, in place if possible.
+  Variable& tuple = var != 0 ? var->updateValue() : currentValue;
+  tuple.type = Constants::ARRAY;
+  tuple.updateTuple().emplace_back(item);
   
-  ParserFunction::addGlobalOrLocalVariable(varName,
-                                           new GetVarFunction(currentValue), isGlobal);
-  
-  return currentValue;
+  if (var == 0) {
+    ParserFunction::addGlobalOrLocalVariable(varName,
+                                             new GetVarFunction(currentValue), isGlobal);
+  }
+  return tuple;
 }
 //-------------------------------------------
 Variable SizeFunction::evaluate(ParsingScript& script)
@@ -264,7 +327,7 @@ Variable SizeFunction::evaluate(ParsingScript& script)
   // 2. Get the current value of the variable.
   ParserFunction* func = ParserFunction::getFunction(varName);
   Utils::checkNotNull(varName, func);
-  Variable currentValue = func->getValue(script);
+  const Variable currentValue = func->getValue(script);
   Variable element = currentValue;
   
   // 2b. Special case for an array.
@@ -277,7 +340,7 @@ Variable SizeFunction::evaluate(ParsingScript& script)
   // string part if it is defined,
   // or the numerical part converted to a string otherwise.
   size_t size = element.type == Constants::ARRAY ?
-                     element.tuple.size() :
+                     element.getTuple().size() :
                      element.toString().size();
   
   Utils::moveForwardIf(script, Constants::END_ARG, Constants::SPACE);
@@ -373,6 +436,12 @@ Variable ForStatement::evaluate(ParsingScript& script)
   return Interpreter::processFor(script);
 }
 
+//-------------------------------------------
+Variable ParallelForStatement::evaluate(ParsingScript& script)
+{
+  return Interpreter::processParallelFor(script);
+}
+
 //-------------------------------------------
 Variable WhileStatement::evaluate(ParsingScript& script)
 {
@@ -391,34 +460,77 @@ Variable GetVarFunction::evaluate(ParsingScript& script)
     }
     script.forward(m_delta);
     
-    Variable* result = extractArrayElement(&m_value, m_arrayIndices);
-    return *result;
+    return *extractArrayElement(&getValue(), m_arrayIndices);
   }
   
   // Otherwise just return the stored value.
-  return m_value;
+  return getValue();
+}
+
+//-------------------------------------------
+Variable ArrayElementFunction::evaluate(ParsingScript& script)
+{
+  if (script.tryPrev() != Constants::START_ARRAY) {
+    return m_array->getValue();
+  }
+  script.forward(m_delta);
+  return *GetVarFunction::extractArrayElement(&m_array->getValue(),
+                                              m_arrayIndices);
+}
+
+//-------------------------------------------
+void GetVarFunction::setVariable(const string& name, const Variable& value,
+                                 bool onlyGlobal)
+{
+  ParserFunction* func = ParserFunction::getVariable(name, onlyGlobal);
+  GetVarFunction* var = dynamic_cast<GetVarFunction*>(func);
+  if (var != 0) {
+    var->updateValue() = value;
+    return;
+  }
+  ParserFunction::addGlobalOrLocalVariable(name, new GetVarFunction(value),
+                                           onlyGlobal);
 }
 
 //-------------------------------------------
+const Variable* GetVarFunction::extractArrayElement(const Variable* array,
+                                                    const vector<Variable>& indices)
+{
+  const Variable* currLevel = array;
+  
+  for (size_t i = 0; i < indices.size(); i++) {
+    size_t arrayIndex = getElementIndex(*currLevel, indices[i]);
+    currLevel = &(currLevel->getTuple()[arrayIndex]);
+  }
+  return currLevel;
+}
+
 Variable* GetVarFunction::extractArrayElement(Variable* array,
                                               const vector<Variable>& indices)
 {
+  // The element is going to be changed, so all the arrays on the way
+  // to it get their own elements if they share them with other copies.
   Variable* currLevel = array;
   
   for (size_t i = 0; i < indices.size(); i++) {
-    const Variable& index = indices[i];
-    size_t arrayIndex = currLevel->getArrayIndex(index);
-    
-    if (arrayIndex >= currLevel->tuple.size()) {
-      throw ParsingException("Unknown index [" + index.toString() +
-                             "] for tuple of size " +
-                             to_string(currLevel->tuple.size()));
-    }
-    currLevel = &(currLevel->tuple[arrayIndex]);
+    size_t arrayIndex = getElementIndex(*currLevel, indices[i]);
+    currLevel = &(currLevel->updateTuple()[arrayIndex]);
   }
   return currLevel;
 }
 
+size_t GetVarFunction::getElementIndex(const Variable& array, const Variable& index)
+{
+  size_t arrayIndex = array.getArrayIndex(index);
+  
+  if (arrayIndex >= array.getTuple().size()) {
+    throw ParsingException("Unknown index [" + index.toString() +
+                           "] for tuple of size " +
+                           to_string(array.getTuple().size()));
+  }
+  return arrayIndex;
+}
+
 //-------------------------------------------
 Variable FunctionCreator::evaluate(ParsingScript& script)
 {
@@ -433,12 +545,147 @@ Variable FunctionCreator::evaluate(ParsingScript& script)
   string body = Utils::getBodyBetween(script,
                                       Constants::START_GROUP, Constants::END_GROUP);
   
-  CustomFunction* customFunc = new CustomFunction(funcName, body, args,                                                 script, parentOffset);
+  CustomFunction* customFunc = new CustomFunction(funcName, body, args,
+                                                  script, parentOffset);
   ParserFunction::addGlobalFunction(funcName, customFunc, false);
   
   return Variable(funcName);
 }
 
+//-------------------------------------------
+CustomFunction::CustomFunction(const string&         funcName,
+                               const string&         funcBody,
+                               const vector<string>& args,
+                               const ParsingScript&  parentScript,
+                               size_t                parentOffset) :
+  m_args(args), m_parentOffset(parentOffset),
+  m_cache(make_shared<ScriptCache>())
+{
+  m_name = funcName;
+  // The body shares the file, the original script and the line numbers
+  // with the script where the function is defined.
+  const ScriptSource& parent = *parentScript.getSource();
+  shared_ptr<ScriptSource> source = make_shared<ScriptSource>();
+  source->data           = funcBody;
+  source->filename       = parent.filename;
+  source->originalScript = parent.originalScript;
+  source->lines          = parent.lines;
+  Utils::matchBraces(source->data, source->matches);
+  m_source = source;
+  
+  initSlots();
+}
+
+void CustomFunction::initSlots()
+{
+  // Every name in the body that may be a variable gets a slot: the
+  // arguments first and then everything that isn't followed by "(".
+  // Locals that aren't found here (e.g. with non-ASCII names) are
+  // still kept by name in the stack level.
+  m_slots = make_shared<LocalSlots>();
+  for (size_t i = 0; i < m_args.size(); i++) {
+    m_argSlots.push_back(m_slots->add(m_args[i]));
+  }
+  
+  const string& body = m_source->data;
+  bool inQuotes = false;
+  for (size_t i = 0; i < body.size(); i++) {
+    char ch = body[i];
+    if (ch == Constants::QUOTE && (i == 0 || body[i - 1] != '\\')) {
+      inQuotes = !inQuotes;
+      continue;
+    }
+    char prev = i > 0 ? body[i - 1] : Constants::NULL_CHAR;
+    bool startsName = !inQuotes && (isalpha(ch) || ch == '_') &&
+                      !isalnum(prev) && prev != '_' && prev != '.';
+    if (!startsName) {
+      continue;
+    }
+    
+    size_t end = i;
+    while (end < body.size() && (isalnum(body[end]) || body[end] == '_')) {
+      end++;
+    }
+    size_t next = body.find_first_not_of(Constants::SPACE, end);
+    if (next == string::npos || body[next] != Constants::START_ARG) {
+      m_slots->add(body.substr(i, end - i));
+    }
+    i = end - 1;
+  }
+  
+  m_cache->setSlots(m_slots);
+}
+
+bool CustomFunction::isReturnExpression(size_t maxSize, size_t& from) const
+{
+  const string& body = m_source->data;
+  if (body.size() > maxSize) {
+    return false;
+  }
+  
+  size_t start = body.find_first_not_of(Constants::SPACE);
+  if (start == string::npos || body.compare(start, Constants::RETURN.size(),
+                                            Constants::RETURN) != 0) {
+    return false;
+  }
+  start += Constants::RETURN.size();
+  if (start >= body.size() || body[start] != Constants::SPACE) {
+    return false;
+  }
+  
+  // The only statement ends with the end of the body.
+  size_t end = body.find(Constants::END_STATEMENT, start);
+  if (end == string::npos ||
+      body.find_first_not_of(Constants::SPACE, end + 1) != string::npos) {
+    return false;
+  }
+  from = start + 1;
+  return true;
+}
+
+void CustomFunction::addArgs(const vector<Variable>& args)
+{
+  for (size_t i = 0; i < m_args.size(); i++) {
+    ParserFunction::setLocalVariable(m_slots.get(), m_argSlots[i],
+                                     new GetVarFunction(args[i]));
+  }
+}
+
+bool CustomFunction::isTailCall(const ParsingScript& script, size_t& argsStart) const
+{
+  // Only the statements of the body itself, not those in its blocks:
+  // a return from a try-block must stay in it.
+  const string& body = script.getData();
+  size_t pos = script.getPointer();
+  if (body.compare(pos, Constants::RETURN.size(), Constants::RETURN) != 0) {
+    return false;
+  }
+  pos += Constants::RETURN.size();
+  if (pos >= body.size() || body[pos] != Constants::SPACE) {
+    return false;
+  }
+  pos++;
+  if (body.compare(pos, m_name.size(), m_name) != 0) {
+    return false;
+  }
+  pos += m_name.size();
+  if (pos >= body.size() || body[pos] != Constants::START_ARG) {
+    return false;
+  }
+  size_t end = script.findMatch(pos);
+  if (end == string::npos || end + 1 >= body.size() ||
+      body[end + 1] != Constants::END_STATEMENT) {
+    return false;
+  }
+  
+  // The name may be hidden by a local variable or the function redefined.
+  if (ParserFunction::getFunction(m_name) != this) {
+    return false;
+  }
+  argsStart = pos + 1;
+  return true;
+}
+
 //-------------------------------------------
 string CustomFunction::getHeader()
 {
@@ -468,24 +715,35 @@ Variable CustomFunction::evaluate(ParsingScript& script)
   Utils::checkArgsNumber(m_args.size(), args.size(), m_name);
   
   // 1. Add passed arguments as local variables to the Parser.
-  StackLevel stackLevel(m_name);
-  
-  for (size_t i = 0; i < m_args.size(); i++) {
-    stackLevel.variables[m_args[i]] = new GetVarFunction(args[i]);
-  }
-  
-  ParserFunction::addLocalVariables(stackLevel);
+  ParserFunction::addStackLevel(m_name, m_slots.get());
+  addArgs(args);
   
   // 2. Execute the body of the function.
   Variable result;
-  ParsingScript funcScript(m_body);
+  ParsingScript funcScript(m_source);
   funcScript.setOffset(m_parentOffset);
-  funcScript.setChar2Line(m_parentScript.getChar2Line());
-  funcScript.setFilename(m_parentScript.getFilename());
-  funcScript.setOriginalScript(m_parentScript.getOriginalScript());
+  funcScript.setCache(m_cache);
 
   while (funcScript.getPointer() < funcScript.size() - 1 && !result.isReturn) {
-    result = Parser::loadAndCalculate(funcScript, Constants::END_PARSING_STR);
+    result = Variable::emptyInstance; // see Interpreter::processBlock()
+    
+    size_t argsStart = 0;
+    if (isTailCall(funcScript, argsStart)) {
+      // Instead of a nested call, the function starts over in a new
+      // stack level with the new arguments.
+      funcScript.setPointer(argsStart);
+      args = Utils::getArgs(funcScript, Constants::START_ARG, Constants::END_ARG, isList);
+      Utils::checkArgsNumber(m_args.size(), args.size(), m_name);
+      ParserFunction::popLocalVariables();
+      ParserFunction::addStackLevel(m_name, m_slots.get());
+      addArgs(args);
+      funcScript.setPointer(0);
+      continue;
+    }
+    
+    if (!Interpreter::runBytecode(funcScript, result)) {
+      result = Parser::loadAndCalculate(funcScript, Constants::END_PARSING_STR);
+    }
     Utils::goToNextStatement(funcScript);
   }
   
@@ -538,13 +796,16 @@ Variable IncludeFunction::evaluate(ParsingScript& script)
   string filename = arg.toString();
   
   string includeFile = Utils::getFileContents(filename);
-  unordered_map<size_t, size_t> char2Line;
-  string includeScript = Utils::convertToScript(includeFile, char2Line);
+  shared_ptr<LineIndex> lines = make_shared<LineIndex>();
+  shared_ptr<ScriptSource> source = make_shared<ScriptSource>();
+  source->data = Utils::convertToScript(includeFile, *lines);
+  source->filename = filename;
+  source->lines = lines;
+  source->originalScript = make_shared<string>(includeFile);
+  Utils::matchBraces(source->data, source->matches);
   
-  ParsingScript tempScript(includeScript);
-  tempScript.setChar2Line(char2Line);
-  tempScript.setOriginalScript(includeFile);
-  tempScript.setFilename(filename);
+  ParsingScript tempScript(source);
+  tempScript.initCache();
 
   while (tempScript.stillValid()) {
     Parser::loadAndCalculate(tempScript,
@@ -575,10 +836,10 @@ Variable ContainsFunction::evaluate(ParsingScript& script)
   
   ParserFunction* func = ParserFunction::getFunction(varName);
   Utils::checkNotNull(varName, func);
-  Variable currentValue = func->getValue(script);
+  const Variable currentValue = func->getValue(script);
   
   // 2b. Special dealings with arrays:
-  Variable* query = !arrayIndices.empty() ?
+  const Variable* query = !arrayIndices.empty() ?
       GetVarFunction::extractArrayElement(&currentValue, arrayIndices) :
       &currentValue;
 
@@ -607,7 +868,7 @@ Variable AssignFunction::evaluate(ParsingScript& script)
   while (varValue.type == Constants::STRING &&
          script.tryPrev() == '+') {
     Variable addition = Utils::getItem(script);
-    varValue.strValue += addition.toString();
+    varValue.updateString() += addition.toString();
   }
   
   // Check if the variable to be set has the form of x[0],
@@ -615,15 +876,21 @@ Variable AssignFunction::evaluate(ParsingScript& script)
   vector<Variable> arrayIndices = Utils::getArrayIndices(m_name);
   
   if (arrayIndices.empty()) {
-    ParserFunction::addGlobalOrLocalVariable(m_name,
-                                             new GetVarFunction(varValue));
+    GetVarFunction::setVariable(m_name, varValue);
     return varValue;
   }
   
-  Variable array;
   // Check if this array already exists.
   bool isGlobal = true;
   ParserFunction* func = ParserFunction::getFunction(m_name, isGlobal);
+  GetVarFunction* var = dynamic_cast<GetVarFunction*>(func);
+  if (var != 0) { // Change the existing array in place.
+    Variable& array = var->updateValue();
+    extendArray(array, arrayIndices, 0, varValue);
+    return array;
+  }
+  
+  Variable array;
   if (func != 0) {
     array = func->getValue(script);
   }
@@ -649,11 +916,11 @@ void AssignFunction::extendArray(Variable& parent,
   size_t currIndex = extendArray(parent, index);
   
   if (arrayIndices.size() - 1 == indexPtr) {
-    parent.tuple[currIndex] = varValue;
+    parent.updateTuple()[currIndex] = varValue;
     return;
   }
   
-  Variable& son = parent.tuple[currIndex];
+  Variable& son = parent.updateTuple()[currIndex];
   extendArray(son, arrayIndices, indexPtr + 1, varValue);
 }
 
@@ -669,9 +936,10 @@ size_t AssignFunction::extendArray(Variable& parent, const Variable& indexVar)
     return arrayIndex;
   }
   
-  if (parent.tuple.size() <= arrayIndex) {
-    for (size_t i = parent.tuple.size(); i <= arrayIndex; i++) {
-      parent.tuple.emplace_back(Variable::emptyInstance);
+  if (parent.getTuple().size() <= arrayIndex) {
+    vector<Variable>& tuple = parent.updateTuple();
+    for (size_t i = tuple.size(); i <= arrayIndex; i++) {
+      tuple.emplace_back(Variable::emptyInstance);
     }
   }
   return arrayIndex;
@@ -732,7 +1000,7 @@ Variable FindFunction::evaluate(ParsingScript& script)
   
   Variable result(Constants::ARRAY);
   for (size_t i = 0; i < results.size(); i++) {
-    result.tuple.emplace_back(results[i]);
+    result.updateTuple().emplace_back(results[i]);
   }
   
   return result;
@@ -777,7 +1045,7 @@ Variable GrepFunction::evaluate(ParsingScript& script)
   
   Variable result(Constants::ARRAY);
   for (size_t i = 0; i < results.size(); i++) {
-    result.tuple.emplace_back(results[i]);
+    result.updateTuple().emplace_back(results[i]);
   }
   
   return result;
@@ -795,7 +1063,7 @@ Variable LsFunction::evaluate(ParsingScript& script)
   vector<string> results = OS::ls(dirname);
   
   for (size_t i = 0; i < results.size(); i++) {
-    result.tuple.emplace_back(results[i]);
+    result.updateTuple().emplace_back(results[i]);
   }
   
   return result;
@@ -865,7 +1133,7 @@ Variable ReadfileFunction::evaluate(ParsingScript& script)
   
   Variable result(Constants::ARRAY);
   for (size_t i = 0; i < linesFile.size(); i++) {
-    result.tuple.emplace_back(linesFile[i]);
+    result.updateTuple().emplace_back(linesFile[i]);
   }
 
   return result;
@@ -953,45 +1221,201 @@ static string threadIdToStr(thread::id threadId)
 }
 
 //-------------------------------------------
-void ThreadFunction::threadWork(const string& body)
+Variable ThreadFunction::threadWork(const string& body,
+                                    const vector<pair<string, Variable>>& locals)
+{
+  // The thread has its own stack of locals, see ParserFunction::Context,
+  // and the body runs in a new level of it: the variables it assigns are
+  // its own, while the global ones are still visible.
+  ParserFunction::addStackLevel(Constants::THREAD);
+  Variable result;
+  try {
+    for (size_t i = 0; i < locals.size(); i++) {
+      GetVarFunction::setVariable(locals[i].first, locals[i].second);
+    }
+    // The result is the value of the last statement, which may have
+    // no ';' after it, as in thread(x * 2).
+    ParsingScript script(body.empty() || body.back() != Constants::END_STATEMENT ?
+                         body + Constants::END_STATEMENT : body);
+    result = script.executeAll();
+  } catch (...) {
+    ParserFunction::popLocalVariables();
+    throw;
+  }
+  ParserFunction::popLocalVariables();
+  result.isReturn = false;
+  return result;
+}
+size_t ThreadFunction::addTask(const shared_ptr<Task>& task)
+{
+  lock_guard<mutex> lock(g_mutex);
+  size_t threadId = ++g_lastThread;
+  g_threads[threadId] = task;
+  return threadId;
+}
+
+shared_ptr<Task> ThreadFunction::takeTask(const Variable& handle)
 {
-  ParsingScript script(body);
-  script.executeAll();
+  Utils::checkNonNegInteger(handle);
+  
+  lock_guard<mutex> lock(g_mutex);
+  auto it = g_threads.find((size_t)handle.numValue);
+  if (it == g_threads.end()) {
+    throw ParsingException("Couldn't find thread [" +
+                           handle.toString() + "]");
+  }
+  shared_ptr<Task> task = it->second;
+  g_threads.erase(it);
+  return task;
+}
+
+vector<shared_ptr<Task>> ThreadFunction::takeTasks(const Variable& handles)
+{
+  vector<shared_ptr<Task>> tasks;
+  unordered_set<size_t> taken;
+  
+  lock_guard<mutex> lock(g_mutex);
+  for (size_t i = 0; i < handles.totalElements(); i++) {
+    const Variable& handle = handles.getValue(i);
+    Utils::checkNonNegInteger(handle);
+    auto it = g_threads.find((size_t)handle.numValue);
+    if (it == g_threads.end()) {
+      throw ParsingException("Couldn't find thread [" +
+                             handle.toString() + "]");
+    }
+    if (!taken.insert(it->first).second) {
+      throw ParsingException("Thread [" + handle.toString() +
+                             "] is given more than once");
+    }
+    tasks.push_back(it->second);
+  }
+  
+  // Only now that all of them are known.
+  for (size_t threadId : taken) {
+    g_threads.erase(threadId);
+  }
+  return tasks;
 }
+
 //-------------------------------------------
 Variable ThreadFunction::evaluate(ParsingScript& script)
 {
-  if (m_join) {
+  if (m_mode == JOIN) {
     Variable threadId = Utils::getItem(script);
-    string threadIdStr = threadId.strValue;
-    Utils::checkNotEmpty(threadIdStr, "threadId");
-    
-    auto it = g_threads.find(threadIdStr);
-    if (it != g_threads.end()) {
-      throw ParsingException("Couldn't find thread [" +
-                             threadIdStr + "]");
-
-    }
-    it->second->join();
-    delete it->second;
-    g_threads.erase(it);
-    return Variable(threadId);
+    return ThreadPool::wait(*takeTask(threadId));
   }
   
   string body = Utils::getBodyBetween(script,
                                       Constants::START_ARG,
                                       Constants::END_ARG);
   
-  std::thread* work = new thread(threadWork, body);
-  string threadId = threadIdToStr(work->get_id());
+  if (m_mode == DETACH) {
+    // Nobody waits for it, so it is not kept after it's done.
+    ThreadPool::submit([body]() {
+      try {
+        threadWork(body);
+      } catch (exception& exc) {
+        OS::printError(exc.what(), true);
+      }
+      return Variable::emptyInstance;
+    });
+    return Variable::emptyInstance;
+  }
   
-  //g_threads[threadId] = work;
-  if (m_detach) {
-    work->detach();
-    //work.join();
+  shared_ptr<Task> task = ThreadPool::submit([body]() {
+    return threadWork(body);
+  });
+  return Variable((double)addTask(task));
+}
+
+//-------------------------------------------
+vector<pair<string, Variable>> AsyncFunction::getNamedValues(const string& expr)
+{
+  vector<pair<string, Variable>> values;
+  unordered_set<string> names;
+  
+  size_t i = 0;
+  while (i < expr.size()) {
+    char ch = expr[i];
+    if (ch == Constants::QUOTE) {
+      // Skip the string, with its escaped quotes.
+      for (i++; i < expr.size() && expr[i] != Constants::QUOTE; i++) {
+        if (expr[i] == '\\') {
+          i++;
+        }
+      }
+      i++;
+      continue;
+    }
+    if (!isalnum((unsigned char)ch) && ch != '_') {
+      i++;
+      continue;
+    }
+    
+    // A number also takes its decimal point, a name stops at a dot,
+    // e.g. at the property in a.size.
+    bool number = isdigit((unsigned char)ch) != 0;
+    size_t start = i;
+    while (i < expr.size() && (isalnum((unsigned char)expr[i]) || expr[i] == '_' ||
+                               (number && expr[i] == '.'))) {
+      i++;
+    }
+    string name = expr.substr(start, i - start);
+    if (number || !names.insert(name).second) {
+      continue; // a number, or already there
+    }
+    GetVarFunction* var = dynamic_cast<GetVarFunction*>(
+                            ParserFunction::getFunction(name));
+    if (var != nullptr) {
+      values.emplace_back(name, var->getValue());
+    }
+  }
+  return values;
+}
+
+Variable AsyncFunction::evaluate(ParsingScript& script)
+{
+  if (m_mode == ASYNC) {
+    string body = Utils::getBodyBetween(script,
+                                        Constants::START_ARG,
+                                        Constants::END_ARG);
+    Utils::checkNotEmpty(body, Constants::ASYNC);
+    
+    // Taken now, in this thread: the variables may change before the
+    // expression runs, e.g. the counter of a loop calling async().
+    vector<pair<string, Variable>> locals = getNamedValues(body);
+    shared_ptr<Task> task = ThreadPool::submit([body, locals]() {
+      return ThreadFunction::threadWork(body, locals);
+    });
+    return Variable((double)ThreadFunction::addTask(task));
   }
   
-  return Variable(threadId);
+  Variable handles = Utils::getItem(script);
+  if (m_mode == AWAIT) {
+    return ThreadPool::wait(*ThreadFunction::takeTask(handles));
+  }
+  
+  if (handles.type != Constants::ARRAY) {
+    throw ParsingException("Expecting an array of handles in " +
+                           Constants::AWAIT_ALL);
+  }
+  vector<shared_ptr<Task>> tasks = ThreadFunction::takeTasks(handles);
+  
+  // All of them are waited for, also after an error, which is thrown
+  // at the end: the first one in the order of the handles.
+  vector<Variable> results;
+  string error;
+  for (size_t i = 0; i < tasks.size(); i++) {
+    try {
+      results.push_back(ThreadPool::wait(*tasks[i]));
+    } catch (exception& exc) {
+      error = error.empty() ? exc.what() : error;
+    }
+  }
+  if (!error.empty()) {
+    throw ParsingException(error);
+  }
+  return Variable(results);
 }
 
 //-------------------------------------------
@@ -1021,6 +1445,7 @@ Variable SignalWaitFunction::evaluate(ParsingScript& script)
     g_signaled = true;
     g_cv.notify_all();
   } else {
+    ThreadPool::Blocked blocked;
     while (!g_signaled) {
       g_cv.wait(lock);
     }
@@ -1030,6 +1455,63 @@ Variable SignalWaitFunction::evaluate(ParsingScript& script)
   return Variable::emptyInstance;
 }
 
+//-------------------------------------------
+shared_ptr<Channel> ChannelFunction::getChannel(const string& name)
+{
+  lock_guard<mutex> lock(g_mutex);
+  auto it = g_channels.find(name);
+  if (it == g_channels.end()) {
+    throw ParsingException("Couldn't find channel [" + name + "]");
+  }
+  return it->second;
+}
+
+Variable ChannelFunction::evaluate(ParsingScript& script)
+{
+  string name = Utils::getItem(script).toString();
+  Utils::checkNotEmpty(name, Constants::CHANNEL);
+  
+  if (m_mode == CREATE) {
+    Variable capacity = Utils::getItem(script);
+    Utils::checkNonNegInteger(capacity);
+    if (capacity.numValue < 1) {
+      throw ParsingException("The capacity of channel [" + name +
+                             "] must be positive");
+    }
+    
+    lock_guard<mutex> lock(g_mutex);
+    if (!g_channels.emplace(name, make_shared<Channel>(
+                              (size_t)capacity.numValue)).second) {
+      throw ParsingException("Channel [" + name + "] already exists");
+    }
+    return Variable::emptyInstance;
+  }
+  
+  shared_ptr<Channel> channel = getChannel(name);
+  switch (m_mode) {
+    case SEND:
+    case SEND_TRY: {
+      Variable value = Utils::getItem(script);
+      bool sent = m_mode == SEND ? channel->send(value) :
+                                   channel->trySend(value);
+      if (!sent && channel->isClosed()) {
+        throw ParsingException("Channel [" + name + "] is closed");
+      }
+      return Variable(sent);
+    }
+    case RECEIVE:
+    case RECEIVE_TRY: {
+      Variable value;
+      bool received = m_mode == RECEIVE ? channel->receive(value) :
+                                          channel->tryReceive(value);
+      return received ? value : Variable::emptyInstance;
+    }
+    default:
+      channel->close();
+      return Variable::emptyInstance;
+  }
+}
+
 //-------------------------------------------
 Variable LockFunction::evaluate(ParsingScript& script)
 {
@@ -1057,7 +1539,7 @@ Variable TypeFunction::evaluate(ParsingScript& script)
   // 2. Get the current value of the variable.
   ParserFunction* func = ParserFunction::getFunction(varName);
   Utils::checkNotNull(varName, func);
-  Variable currentValue = func->getValue(script);
+  const Variable currentValue = func->getValue(script);
   Variable element = currentValue;
   
   // 2b. Special case for an array.
@@ -1096,7 +1578,10 @@ Variable IncrDecrFunction::evaluate(ParsingScript& script)
   ParserFunction* func = ParserFunction::getFunction(m_name, isGlobal);
   Utils::checkNotNull(m_name, func);
   
-  Variable currentValue = func->getValue(script);
+  // Change the variable in place if possible.
+  GetVarFunction* var = dynamic_cast<GetVarFunction*>(func);
+  Variable copy = var != 0 ? Variable::emptyInstance : func->getValue(script);
+  Variable& currentValue = var != 0 ? var->updateValue() : copy;
   
   if (!arrayIndices.empty() || script.tryCurrent() == Constants::START_ARRAY) {// array element
     if (prefix) {
@@ -1117,8 +1602,10 @@ Variable IncrDecrFunction::evaluate(ParsingScript& script)
     currentValue.numValue += valueDelta;
   }
   
-  ParserFunction::addGlobalOrLocalVariable(m_name,
-                                           new GetVarFunction(currentValue), isGlobal);
+  if (var == 0) {
+    ParserFunction::addGlobalOrLocalVariable(m_name,
+                                             new GetVarFunction(currentValue), isGlobal);
+  }
   return newValue;
 }
 
@@ -1141,6 +1628,22 @@ Variable OperatorAssignFunction::evaluate(ParsingScript& script)
   bool isGlobal = true;
   ParserFunction* func = ParserFunction::getFunction(m_name, isGlobal);
   Utils::checkNotNull(m_name, func);
+  
+  GetVarFunction* var = dynamic_cast<GetVarFunction*>(func);
+  if (var != 0) { // Change the variable or its element in place.
+    Variable* left = &var->updateValue();
+    if (!arrayIndices.empty()) {// array element
+      left = GetVarFunction::extractArrayElement(left, arrayIndices);
+      Utils::moveForwardIf(script, Constants::END_ARRAY);
+    }
+    if (left->type == Constants::NUMBER) {
+      numberOperator(*left, right, m_action);
+    } else {
+      stringOperator(*left, right, m_action);
+    }
+    return *left;
+  }
+  
   Variable currentValue = func->getValue(script);
   Variable left = currentValue;
   
@@ -1192,7 +1695,7 @@ void OperatorAssignFunction::stringOperator(Variable& left,
                                             const Variable& right, const string& action)
 {
   if (action.compare("+=") == 0) {
-    left.strValue += right.toString();
+    left.updateString() += right.toString();
   }
 }
 
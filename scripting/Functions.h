@@ -15,6 +15,7 @@
 
 #include "ParserFunction.h"
 #include "Interpreter.h"
+#include "ThreadPool.h"
 #include "UtilsOS.h"
 
 class IfStatement;
@@ -41,6 +42,10 @@ class AbsFunction : public ParserFunction
 {
 public:
   virtual Variable evaluate(ParsingScript& script);
+  // The function itself, without the parsing: the compiled expressions
+  // call it too, see Bytecode::addPureFunction(). The same for the other
+  // math functions.
+  static double compute(const double* args);
 };
 //-------------------------------------------
 class AddFunction : public ParserFunction
@@ -65,12 +70,14 @@ class CeilFunction : public ParserFunction
 {
 public:
   virtual Variable evaluate(ParsingScript& script);
+  static double compute(const double* args);
 };
 //-------------------------------------------
 class CosFunction : public ParserFunction
 {
 public:
   virtual Variable evaluate(ParsingScript& script);
+  static double compute(const double* args);
 };
 //-------------------------------------------
 class EnvFunction : public ParserFunction
@@ -89,12 +96,14 @@ class ExpFunction : public ParserFunction
 {
 public:
   virtual Variable evaluate(ParsingScript& script);
+  static double compute(const double* args);
 };
 //-------------------------------------------
 class FloorFunction : public ParserFunction
 {
 public:
   virtual Variable evaluate(ParsingScript& script);
+  static double compute(const double* args);
 };
 //-------------------------------------------
 class IndexOfFunction : public ParserFunction
@@ -107,6 +116,7 @@ class LogFunction : public ParserFunction
 {
 public:
   virtual Variable evaluate(ParsingScript& script);
+  static double compute(const double* args);
 };
 
 //-------------------------------------------
@@ -114,12 +124,14 @@ class PiFunction : public ParserFunction
 {
 public:
   virtual Variable evaluate(ParsingScript& script);
+  static double compute(const double* args);
 };
 //-------------------------------------------
 class PowFunction : public ParserFunction
 {
 public:
   virtual Variable evaluate(ParsingScript& script);
+  static double compute(const double* args);
 };
 //-------------------------------------------
 class ShowFunction : public ParserFunction
@@ -156,18 +168,21 @@ class RoundFunction : public ParserFunction
 {
 public:
   virtual Variable evaluate(ParsingScript& script);
+  static double compute(const double* args);
 };
 //-------------------------------------------
 class SqrtFunction : public ParserFunction
 {
 public:
   virtual Variable evaluate(ParsingScript& script);
+  static double compute(const double* args);
 };
 //-------------------------------------------
 class SinFunction : public ParserFunction
 {
 public:
   virtual Variable evaluate(ParsingScript& script);
+  static double compute(const double* args);
 };
 //-------------------------------------------
 class SizeFunction : public ParserFunction
@@ -221,6 +236,12 @@ public:
   virtual Variable evaluate(ParsingScript& script);
 };
 //-------------------------------------------
+class ParallelForStatement : public ParserFunction
+{
+public:
+  virtual Variable evaluate(ParsingScript& script);
+};
+//-------------------------------------------
 class IfStatement : public ParserFunction
 {
 public:
@@ -260,21 +281,37 @@ public:
                  const string&         funcBody,
                  const vector<string>& args,
                  const ParsingScript&  parentScript,
-                 size_t                parentOffset = 0) :
-    m_body(funcBody), m_args(args), m_parentScript(parentScript),
-    m_parentOffset(parentOffset)
-  { m_name = funcName;}
+                 size_t                parentOffset = 0);
   
   virtual Variable evaluate(ParsingScript& script);
   
-  string getBody() { return m_body; }
+  string getBody() { return m_source->data; }
   string getHeader();
   
+  const vector<string>& getArgs() const { return m_args; }
+  const shared_ptr<const ScriptSource>& getSource() const { return m_source; }
+  
+  // Whether the body is just "return expression;" and not longer than
+  // maxSize, as the functions that can be inlined, see Bytecode.
+  // If so, from is set to the start of the expression.
+  bool isReturnExpression(size_t maxSize, size_t& from) const;
+  
 private:
-  string         m_body;
+  void initSlots();
+  void addArgs(const vector<Variable>& args);
+  // Whether the statement is "return name(...);", calling this function.
+  bool isTailCall(const ParsingScript& script, size_t& argsStart) const;
+  
   vector<string> m_args;
-  ParsingScript  m_parentScript;
   size_t         m_parentOffset = 0;
+  shared_ptr<const ScriptSource> m_source; // the body
+  
+  // Tokens of the body, kept between the calls.
+  shared_ptr<ScriptCache> m_cache;
+  
+  // Slots of the arguments and of the other names used in the body.
+  shared_ptr<LocalSlots> m_slots;
+  vector<int>            m_argSlots;
 };
 
 //-------------------------------------------
@@ -300,27 +337,78 @@ private:
 };
 
 //-------------------------------------------
-class GetVarFunction : public ParserFunction
+class GetVarFunction : public ParserFunction, public Pooled<GetVarFunction>
 {
 public:
   GetVarFunction(const Variable& value) :
-          m_value(value), m_delta(0) {}
+          m_delta(0), m_value(value) {}
+  // The value is made by init() when the variable is used for the first
+  // time, e.g. the message of a caught exception.
+  GetVarFunction(const function<Variable()>& init) :
+          m_delta(0), m_init(init) {}
   virtual Variable evaluate(ParsingScript& script);
   
-  const Variable& getValue() const { return m_value; };
+  const Variable& getValue() const
+  {
+    if (m_init) {
+      m_value = m_init();
+      m_init = nullptr;
+    }
+    return m_value;
+  }
+  
+  // For changing the variable in place. Forgets the cached array indices,
+  // the same as for a newly assigned variable.
+  Variable& updateValue()
+  {
+    m_arrayIndices.clear(); m_delta = 0;
+    m_init = nullptr;
+    return m_value;
+  }
+  
+  // Same as ParserFunction::addGlobalOrLocalVariable() with a new
+  // GetVarFunction, but reuses the variable if it already exists.
+  static void setVariable(const string& name, const Variable& value,
+                          bool onlyGlobal = false);
+  
   void setIndices(const vector<Variable>& arrayIndices)
           { m_arrayIndices = arrayIndices; }
   void setDelta(size_t delta)
           { m_delta = delta; }
   
+  static const Variable* extractArrayElement(const Variable* array,
+                                             const vector<Variable>& indices);
   static Variable* extractArrayElement(Variable* array,
                                        const vector<Variable>& indices);
 private:
+  static size_t getElementIndex(const Variable& array, const Variable& index);
+  
   size_t m_delta;
-  Variable m_value;
+  mutable Variable m_value;
+  mutable function<Variable()> m_init;
   vector<Variable> m_arrayIndices;
 };
 
+//-------------------------------------------
+// An element of an array variable, e.g. a[i][1]. Made for every use of the
+// element, so the indices aren't kept in the variable: it may be a global
+// one used by several threads at once.
+class ArrayElementFunction : public ParserFunction,
+                             public Pooled<ArrayElementFunction>
+{
+public:
+  ArrayElementFunction(const GetVarFunction* array,
+                       const vector<Variable>& arrayIndices, size_t delta) :
+          m_array(array), m_arrayIndices(arrayIndices), m_delta(delta)
+  { setNewInstance(); }
+  virtual Variable evaluate(ParsingScript& script);
+  
+private:
+  const GetVarFunction* m_array;
+  vector<Variable>      m_arrayIndices;
+  size_t                m_delta;
+};
+
 //-------------------------------------------
 //-------------------------------------------
 class CdFunction : public ParserFunction
@@ -456,26 +544,87 @@ private:
   static std::condition_variable g_cv;
 };
 //-------------------------------------------
+// The channels by name:
+//   channel(name, capacity) creates one, an error if the name is taken:
+//     the threads using the old one would wait on it forever,
+//   send(name, value) waits while it is full, trysend() returns false,
+//   receive(name) waits while it is empty, tryreceive() doesn't. Both
+//     return null if there is no value and the channel is closed,
+//   close(name) lets the receivers finish, sending to it is an error.
+class ChannelFunction : public ParserFunction
+{
+public:
+  enum Mode { CREATE, SEND, SEND_TRY, RECEIVE, RECEIVE_TRY, CLOSE };
+  
+  ChannelFunction(Mode mode) : m_mode(mode) {}
+  
+  virtual Variable evaluate(ParsingScript& script);
+private:
+  static shared_ptr<Channel> getChannel(const string& name);
+  
+  Mode m_mode;
+  
+  static unordered_map<string, shared_ptr<Channel>> g_channels;
+  static mutex g_mutex;
+};
+//-------------------------------------------
 class WaitThreadFunction : public ParserFunction
 {
 public:
   virtual Variable evaluate(ParsingScript& script);
 };
 //-------------------------------------------
+// Runs the body on the ThreadPool. thread() doesn't wait for it, and an
+// error in it is only printed. threadj() returns its handle, a number:
+// joining the handle waits for the body and returns its result.
 class ThreadFunction : public ParserFunction
 {
 public:
-  ThreadFunction(bool detach = true, bool waitThread = false)
-  : m_detach(detach), m_join(waitThread) {}
+  enum Mode { DETACH, JOINABLE, JOIN };
+  
+  ThreadFunction(Mode mode) : m_mode(mode) {}
   
   virtual Variable evaluate(ParsingScript& script);
+  
+  // Runs the body in a new stack level with the given locals.
+  static Variable threadWork(const string& body,
+                             const vector<pair<string, Variable>>& locals = {});
+  
+  // Registers the task and returns its handle.
+  static size_t addTask(const shared_ptr<Task>& task);
+  // Unregisters the task with the handle, it can only be waited for once.
+  static shared_ptr<Task> takeTask(const Variable& handle);
+  // Same for all the handles, or for none if any of them is unknown.
+  static vector<shared_ptr<Task>> takeTasks(const Variable& handles);
 
 private:
-  static void threadWork(const string& body);
-  bool m_detach;
-  bool m_join;
+  Mode m_mode;
+  
+  // The threads that weren't joined yet, by handle.
+  static unordered_map<size_t, shared_ptr<Task>> g_threads;
+  static size_t g_lastThread;
+  static mutex  g_mutex;
+};
+//-------------------------------------------
+// async(expr) evaluates the expression on the ThreadPool and returns its
+// handle, the same as threadj(). The expression gets a copy of the
+// variables it names, local or global, as they are when async() is
+// called, e.g. async(square(i)) in a loop gets the current i.
+// await(handle) returns the value of the expression or throws its error,
+// await_all(handles) returns the array of the values in the same order.
+class AsyncFunction : public ParserFunction
+{
+public:
+  enum Mode { ASYNC, AWAIT, AWAIT_ALL };
+  
+  AsyncFunction(Mode mode) : m_mode(mode) {}
+  
+  virtual Variable evaluate(ParsingScript& script);
+private:
+  // The names and values of the variables used in the expression.
+  static vector<pair<string, Variable>> getNamedValues(const string& expr);
   
-  static unordered_map<string, thread*> g_threads;
+  Mode m_mode;
 };
 //-------------------------------------------
 class ThreadIDFunction : public ParserFunction
@@ -492,14 +641,14 @@ public:
 
 //-------------------------------------------
 //-------------------------------------------
-class IncrDecrFunction : public ActionFunction
+class IncrDecrFunction : public ActionFunction, public Pooled<IncrDecrFunction>
 {
 public:
   virtual Variable evaluate(ParsingScript& script);
   virtual ActionFunction* newInstance();
 };
 //-------------------------------------------
-class AssignFunction : public ActionFunction
+class AssignFunction : public ActionFunction, public Pooled<AssignFunction>
 {
 public:
   virtual Variable evaluate(ParsingScript& script);
@@ -513,7 +662,8 @@ private:
   static size_t extendArray(Variable& parent, const Variable& indexVar);
 };
 //-------------------------------------------
-class OperatorAssignFunction : public ActionFunction
+class OperatorAssignFunction : public ActionFunction,
+                               public Pooled<OperatorAssignFunction>
 {
 public:
   virtual Variable evaluate(ParsingScript& script);
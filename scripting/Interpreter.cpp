@@ -9,11 +9,17 @@
 #include <iostream>
 
 #include "Interpreter.h"
+#include "Bytecode.h"
 #include "Functions.h"
 #include "Parser.h"
 #include "ParserFunction.h"
+#include "ThreadPool.h"
 #include "Translation.h"
 
+#include <limits>
+
+bool Interpreter::s_useBytecode = false;
+
 void Interpreter::init()
 {
   ParserFunction::addGlobalFunction(Constants::ALL,         new AllFunctions());
@@ -23,6 +29,7 @@ void Interpreter::init()
   ParserFunction::addGlobalFunction(Constants::CONTINUE,    new ContinueStatement());
   ParserFunction::addGlobalFunction(Constants::EXIT,        new ExitStatement());
   ParserFunction::addGlobalFunction(Constants::FOR,         new ForStatement());
+  ParserFunction::addGlobalFunction(Constants::PARALLEL_FOR, new ParallelForStatement());
   ParserFunction::addGlobalFunction(Constants::FUNCTION,    new FunctionCreator());
   ParserFunction::addGlobalFunction(Constants::INCLUDE,     new IncludeFunction());
   ParserFunction::addGlobalFunction(Constants::IF,          new IfStatement());
@@ -35,14 +42,19 @@ void Interpreter::init()
   ParserFunction::addGlobalFunction(Constants::ABS,         new AbsFunction());
   ParserFunction::addGlobalFunction(Constants::ADD,         new AddFunction());
   ParserFunction::addGlobalFunction(Constants::APPENDLINE,  new AppendlineFunction());
+  ParserFunction::addGlobalFunction(Constants::ASYNC,       new AsyncFunction(AsyncFunction::ASYNC));
+  ParserFunction::addGlobalFunction(Constants::AWAIT,       new AsyncFunction(AsyncFunction::AWAIT));
+  ParserFunction::addGlobalFunction(Constants::AWAIT_ALL,   new AsyncFunction(AsyncFunction::AWAIT_ALL));
   ParserFunction::addGlobalFunction(Constants::CEIL,        new CeilFunction());
+  ParserFunction::addGlobalFunction(Constants::CHANNEL,     new ChannelFunction(ChannelFunction::CREATE));
+  ParserFunction::addGlobalFunction(Constants::CLOSE,       new ChannelFunction(ChannelFunction::CLOSE));
   ParserFunction::addGlobalFunction(Constants::COS,         new CosFunction());
   ParserFunction::addGlobalFunction(Constants::CONTAINS,    new ContainsFunction());
   ParserFunction::addGlobalFunction(Constants::EXP,         new ExpFunction());
   ParserFunction::addGlobalFunction(Constants::FLOOR,       new FloorFunction());
   ParserFunction::addGlobalFunction(Constants::ISNULL,      new IsNullFunction());
   ParserFunction::addGlobalFunction(Constants::INDEX_OF,    new IndexOfFunction());
-  ParserFunction::addGlobalFunction(Constants::JOIN,        new ThreadFunction(false, true));
+  ParserFunction::addGlobalFunction(Constants::JOIN,        new ThreadFunction(ThreadFunction::JOIN));
   ParserFunction::addGlobalFunction(Constants::LOG,         new LogFunction());
   ParserFunction::addGlobalFunction(Constants::LOCK,        new LockFunction());
   ParserFunction::addGlobalFunction(Constants::MORE,        new MoreFunction());
@@ -58,8 +70,12 @@ void Interpreter::init()
   ParserFunction::addGlobalFunction(Constants::READ,        new ReadFunction());
   ParserFunction::addGlobalFunction(Constants::READFILE,    new ReadfileFunction());
   ParserFunction::addGlobalFunction(Constants::READNUM,     new ReadnumFunction());
+  ParserFunction::addGlobalFunction(Constants::RECEIVE,     new ChannelFunction(ChannelFunction::RECEIVE));
+  ParserFunction::addGlobalFunction(Constants::RECEIVE_TRY, new ChannelFunction(ChannelFunction::RECEIVE_TRY));
   ParserFunction::addGlobalFunction(Constants::ROUND,       new RoundFunction());
   ParserFunction::addGlobalFunction(Constants::RUN,         new RunFunction());
+  ParserFunction::addGlobalFunction(Constants::SEND,        new ChannelFunction(ChannelFunction::SEND));
+  ParserFunction::addGlobalFunction(Constants::SEND_TRY,    new ChannelFunction(ChannelFunction::SEND_TRY));
   ParserFunction::addGlobalFunction(Constants::SHOW,        new ShowFunction());
   ParserFunction::addGlobalFunction(Constants::SIGNAL,      new SignalWaitFunction(true));
   ParserFunction::addGlobalFunction(Constants::SIN,         new SinFunction());
@@ -68,9 +84,9 @@ void Interpreter::init()
   ParserFunction::addGlobalFunction(Constants::SLEEP,       new SleepFunction());
   ParserFunction::addGlobalFunction(Constants::SUBSTR,      new SubstrFunction());
   ParserFunction::addGlobalFunction(Constants::TAIL,        new TailFunction());
-  ParserFunction::addGlobalFunction(Constants::THREAD,      new ThreadFunction(true));
+  ParserFunction::addGlobalFunction(Constants::THREAD,      new ThreadFunction(ThreadFunction::DETACH));
   ParserFunction::addGlobalFunction(Constants::THREAD_ID,   new ThreadIDFunction());
-  ParserFunction::addGlobalFunction(Constants::THREAD_J,    new ThreadFunction(false));
+  ParserFunction::addGlobalFunction(Constants::THREAD_J,    new ThreadFunction(ThreadFunction::JOINABLE));
   ParserFunction::addGlobalFunction(Constants::TRANSLATE,   new TranslateFunction());
   ParserFunction::addGlobalFunction(Constants::TOUCH,       new TouchFunction());
   ParserFunction::addGlobalFunction(Constants::TYPE,        new TypeFunction());
@@ -91,6 +107,21 @@ void Interpreter::init()
   ParserFunction::addGlobalFunction(Constants::MOVE,        new RenameFunction());
   ParserFunction::addGlobalFunction(Constants::RM,          new RmFunction());
   
+  // The functions without side effects: the compiled expressions call them
+  // directly, or just once if the arguments are constant.
+  Bytecode::addPureFunction(Constants::ABS,   1, AbsFunction::compute);
+  Bytecode::addPureFunction(Constants::CEIL,  1, CeilFunction::compute);
+  Bytecode::addPureFunction(Constants::COS,   1, CosFunction::compute);
+  Bytecode::addPureFunction(Constants::EXP,   1, ExpFunction::compute);
+  Bytecode::addPureFunction(Constants::FLOOR, 1, FloorFunction::compute);
+  Bytecode::addPureFunction(Constants::LOG,   1, LogFunction::compute);
+  Bytecode::addPureFunction(Constants::PI,    0, PiFunction::compute);
+  Bytecode::addPureFunction(Constants::POW,   2, PowFunction::compute);
+  Bytecode::addPureFunction(Constants::ROUND, 1, RoundFunction::compute);
+  Bytecode::addPureFunction(Constants::SIN,   1, SinFunction::compute);
+  Bytecode::addPureFunction(Constants::SQRT,  1, SqrtFunction::compute);
+  Bytecode::addPureFunction(Constants::SIZE,  1, nullptr);
+  
   // Add operators
   ParserFunction::addAction(Constants::ASSIGN,              new AssignFunction());
   ParserFunction::addAction(Constants::INCREMENT,           new IncrDecrFunction());
@@ -106,18 +137,22 @@ void Interpreter::init()
 
 Variable Interpreter::process(const string& scriptData)
 {
-  unordered_map<size_t, size_t> char2Line;
-  string data = Utils::convertToScript(scriptData, char2Line);
-  if (data.empty()) {
+  shared_ptr<LineIndex> lines = make_shared<LineIndex>();
+  shared_ptr<ScriptSource> source = make_shared<ScriptSource>();
+  source->data = Utils::convertToScript(scriptData, *lines);
+  if (source->data.empty()) {
     return Variable::emptyInstance;
   }
+  source->lines = lines;
+  source->originalScript = make_shared<string>(scriptData);
+  Utils::matchBraces(source->data, source->matches);
   
-  ParsingScript script(data);
-  script.setChar2Line(char2Line);
-  script.setOriginalScript(scriptData);
+  ParsingScript script(source);
+  script.initCache();
   Variable result;
   
   while (script.stillValid()) {
+    result = Variable::emptyInstance; // see processBlock()
     result = Parser::loadAndCalculate(script, Constants::END_PARSING_STR);
     Utils::goToNextStatement(script);
   }
@@ -125,11 +160,40 @@ Variable Interpreter::process(const string& scriptData)
   return result;
 }
 
+bool Interpreter::runBytecode(ParsingScript& script, Variable& result,
+                              char terminator)
+{
+  ScriptCache* cache = script.getCache().get();
+  if (!s_useBytecode || cache == nullptr) {
+    return false;
+  }
+  
+  size_t from = script.getPointer();
+  shared_ptr<Bytecode> program;
+  if (!cache->findProgram(from, program)) {
+    const string& data = script.getData();
+    program = terminator == Constants::NULL_CHAR ?
+              Bytecode::compileStatement(data, from, cache->getSlots()) :
+              Bytecode::compileExpression(data, from, terminator, cache->getSlots());
+    cache->addProgram(from, program);
+  }
+  
+  if (!program || !program->run(result)) {
+    return false;
+  }
+  
+  script.setPointer(program->getEnd());
+  return true;
+}
+
 Variable Interpreter::processIf(ParsingScript& script)
 {
   size_t startIfCondition = script.getPointer();
   
-  Variable result = Parser::loadAndCalculate(script, Constants::END_ARG_STR);
+  Variable result;
+  if (!runBytecode(script, result, Constants::END_ARG)) {
+    result = Parser::loadAndCalculate(script, Constants::END_ARG_STR);
+  }
   bool isTrue = result.numValue != 0;
   
   if (isTrue) {
@@ -148,17 +212,19 @@ Variable Interpreter::processIf(ParsingScript& script)
   // We are in Else. Skip everything in the If statement.
   skipBlock(script);
   
-  ParsingScript nextData(script);
-  string nextToken = Utils::getNextToken(nextData);
+  size_t afterIf = script.getPointer();
+  string nextToken = Utils::getNextToken(script);
+  size_t afterToken = script.getPointer();
+  script.setPointer(afterIf);
   
   if (Constants::ELSE_IF_LIST.find(nextToken) !=
       Constants::ELSE_IF_LIST.end()) {
-    script.setPointer(nextData.getPointer() + 1);
+    script.setPointer(afterToken + 1);
     result = processIf(script);
   }
   if (Constants::ELSE_LIST.find(nextToken) !=
       Constants::ELSE_LIST.end()) {
-    script.setPointer(nextData.getPointer() + 1);
+    script.setPointer(afterToken + 1);
     result = processBlock(script);
   }
   
@@ -167,12 +233,13 @@ Variable Interpreter::processIf(ParsingScript& script)
 
 Variable Interpreter::processFor(ParsingScript& script)
 {
+  size_t headerStart = script.getPointer();
   string forString = Utils::getBodyBetween(script, Constants::START_ARG, Constants::END_ARG);
   script.forward();
   
   if (forString.find(Constants::END_STATEMENT) != string::npos) {
     // Looks like: "for(i = 0; i < 10; i++)".
-    processCanonicalFor(script, forString);
+    processCanonicalFor(script, forString, headerStart);
   } else {
     // Otherwise looks like: "for(item : array)"
     processArrayFor(script, forString);
@@ -191,19 +258,17 @@ void Interpreter::processArrayFor(ParsingScript& script, const string& forString
   string varName = forString.substr(0, index);
   
   ParsingScript forScript(forString);
-  Variable arrayValue = forScript.executeFrom(index + 1);
+  const Variable arrayValue = forScript.executeFrom(index + 1);
 
   size_t cycles = arrayValue.totalElements();
   size_t startForCondition = script.getPointer();
-  Variable result;
   
   for (size_t i = 0; i < cycles; i++) {
     script.setPointer(startForCondition);
-    Variable& current = arrayValue.getValue(i);
-    ParserFunction::addGlobalOrLocalVariable(varName,
-                                             new GetVarFunction(current));
+    const Variable& current = arrayValue.getValue(i);
+    GetVarFunction::setVariable(varName, current);
     
-    result = processBlock(script);
+    Variable result = processBlock(script);
     if (result.isReturn || result.type == Constants::BREAK_STATEMENT) {
       script.setPointer(startForCondition);
       break;
@@ -211,31 +276,62 @@ void Interpreter::processArrayFor(ParsingScript& script, const string& forString
   }
 }
 
-void Interpreter::processCanonicalFor(ParsingScript& script, const string& forString)
+shared_ptr<ForLoop> Interpreter::getForLoop(ParsingScript& script, const string& forString,
+                                            size_t headerStart)
 {
-  vector<string> forTokens = Utils::tokenize(forString, string(1, Constants::END_STATEMENT));
-  if (forTokens.size() != 3) {
-    throw ParsingException("Expecting: for(init; condition; loopStatement)");
+  // The header is compiled once per script position.
+  ScriptCache* cache = script.getCache().get();
+  shared_ptr<ForLoop> loop = cache != nullptr ? cache->findLoop(headerStart) : nullptr;
+  if (!loop) {
+    loop = ForLoop::compile(forString, cache != nullptr ?
+                            cache->getSharedSlots() : nullptr);
+    if (cache != nullptr) {
+      cache->addLoop(headerStart, loop);
+    }
+  }
+  return loop;
+}
+
+bool Interpreter::checkForCondition(const ForLoop& loop, ParsingScript& condScript)
+{
+  bool isTrue = false;
+  if (!loop.checkCondition(isTrue)) {
+    Variable condResult;
+    condScript.setPointer(0);
+    if (!runBytecode(condScript, condResult, Constants::END_STATEMENT)) {
+      condResult = condScript.executeFrom(0);
+    }
+    isTrue = condResult.numValue != 0;
+  }
+  return isTrue;
+}
+
+void Interpreter::doForStep(const ForLoop& loop, ParsingScript& stepScript)
+{
+  if (!loop.step()) {
+    Variable stepResult;
+    stepScript.setPointer(0);
+    if (!runBytecode(stepScript, stepResult)) {
+      stepScript.executeFrom(0);
+    }
   }
+}
+
+void Interpreter::processCanonicalFor(ParsingScript& script, const string& forString,
+                                      size_t headerStart)
+{
+  shared_ptr<ForLoop> loop = getForLoop(script, forString, headerStart);
   
-  ParsingScript initScript(forTokens[0] + Constants::END_STATEMENT);
-  ParsingScript condScript(forTokens[1] + Constants::END_STATEMENT);
-  ParsingScript loopScript(forTokens[2] + Constants::END_STATEMENT);
+  ParsingScript initScript = loop->getScript(ForLoop::INIT);
+  ParsingScript condScript = loop->getScript(ForLoop::CONDITION);
+  ParsingScript loopScript = loop->getScript(ForLoop::STEP);
   
   initScript.execute();
 
   size_t startForCondition = script.getPointer();
   int cycles = 0;
-  bool stillValid = true;
-  Variable result;
   
-  while (stillValid) {
-    Variable condResult = condScript.executeFrom(0);
-    stillValid = condResult.numValue != 0;
-    if (!stillValid) {
-      break;
-    }
-
+  while (checkForCondition(*loop, condScript)) {
     script.setPointer(startForCondition);
     
     // Check for an infinite loop if we are comparing same values:
@@ -244,13 +340,302 @@ void Interpreter::processCanonicalFor(ParsingScript& script, const string& forSt
                              to_string(cycles) + " cycles.");
     }
     
-    result = processBlock(script);
+    Variable result = processBlock(script);
     if (result.isReturn || result.type == Constants::BREAK_STATEMENT) {
       script.setPointer(startForCondition);
       skipBlock(script);
       break;
     }
-    loopScript.executeFrom(0);
+    doForStep(*loop, loopScript);
+  }
+}
+
+// The state of a parallel_for shared by the threads running it.
+struct Interpreter::ParallelLoop
+{
+  enum Reduce { SUM, MIN, MAX, APPEND };
+  
+  struct Reduction
+  {
+    Reduce type;
+    string name;
+  };
+  
+  ParallelLoop(const ParsingScript& script) : body(script) {}
+  
+  // The value each chunk starts with.
+  static Variable identity(Reduce type);
+  static void combine(Variable& result, const Variable& partial, Reduce type);
+  
+  ParsingScript     body; // at the start of the block
+  string            varName;
+  vector<Variable>  values; // of the loop variable, in order
+  vector<Reduction> reductions;
+  // The locals of the calling thread, copied into every chunk.
+  vector<pair<string, Variable>> locals;
+  
+  // The iterations are split into chunks of the consecutive ones.
+  size_t chunkSize = 1;
+  size_t chunks    = 0;
+  atomic<size_t> nextChunk{0};
+  atomic<bool>   failed{false};
+  vector<vector<Variable>> partials; // the reductions of each chunk
+};
+
+Variable Interpreter::ParallelLoop::identity(Reduce type)
+{
+  switch (type) {
+    case MIN:    return Variable(numeric_limits<double>::max());
+    case MAX:    return Variable(numeric_limits<double>::lowest());
+    case APPEND: return Variable(vector<Variable>());
+    default:     return Variable(0.0);
+  }
+}
+
+void Interpreter::ParallelLoop::combine(Variable& result, const Variable& partial,
+                                        Reduce type)
+{
+  if (result.type == Constants::NONE) {
+    result = partial;
+    return;
+  }
+  switch (type) {
+    case SUM:
+      result.numValue += partial.numValue;
+      break;
+    case MIN:
+      result.numValue = min(result.numValue, partial.numValue);
+      break;
+    case MAX:
+      result.numValue = max(result.numValue, partial.numValue);
+      break;
+    case APPEND: {
+      if (result.type != Constants::ARRAY) {
+        result = Variable(vector<Variable>(1, result));
+      }
+      vector<Variable>& tuple = result.updateTuple();
+      if (partial.type == Constants::ARRAY) {
+        const vector<Variable>& elements = partial.getTuple();
+        tuple.insert(tuple.end(), elements.begin(), elements.end());
+      } else {
+        tuple.push_back(partial);
+      }
+      break;
+    }
+  }
+}
+
+Variable Interpreter::processParallelFor(ParsingScript& script)
+{
+  size_t headerStart = script.getPointer();
+  string forString = Utils::getBodyBetween(script, Constants::START_ARG, Constants::END_ARG);
+  script.forward();
+  
+  shared_ptr<ParallelLoop> loop = make_shared<ParallelLoop>(script);
+  readReductions(script, *loop);
+  
+  // 1. The values of the loop variable are found first, in this thread.
+  if (forString.find(Constants::END_STATEMENT) != string::npos) {
+    readCounterValues(script, forString, headerStart, *loop);
+  } else {
+    size_t index = forString.find(Constants::FOR_ANY);
+    if (index == string::npos || index == forString.size() - 1) {
+      throw ParsingException("Expecting: " + Constants::PARALLEL_FOR + "(item : array)");
+    }
+    loop->varName = forString.substr(0, index);
+    ParsingScript forScript(forString);
+    const Variable arrayValue = forScript.executeFrom(index + 1);
+    for (size_t i = 0; i < arrayValue.totalElements(); i++) {
+      loop->values.push_back(arrayValue.getValue(i));
+    }
+  }
+  size_t blockStart = script.getPointer();
+  loop->body.setPointer(blockStart);
+  loop->locals = ParserFunction::getLocalValues();
+  
+  // 2. A few chunks per worker, so that the workers done first take
+  // the chunks left from the others. This thread runs them too.
+  size_t workers = ThreadPool::size();
+  loop->chunkSize = max(loop->values.size() / (workers * 4), (size_t)1);
+  loop->chunks = (loop->values.size() + loop->chunkSize - 1) / loop->chunkSize;
+  loop->partials.resize(loop->chunks);
+  
+  vector<shared_ptr<Task>> tasks;
+  for (size_t i = 1; i < min(workers, loop->chunks); i++) {
+    tasks.push_back(ThreadPool::submit([loop]() {
+      runParallelChunks(*loop);
+      return Variable::emptyInstance;
+    }));
+  }
+  
+  string error;
+  try {
+    runParallelChunks(*loop);
+  } catch (exception& exc) {
+    error = exc.what();
+  }
+  for (size_t i = 0; i < tasks.size(); i++) {
+    try {
+      ThreadPool::wait(*tasks[i]);
+    } catch (exception& exc) {
+      error = error.empty() ? exc.what() : error;
+    }
+  }
+  if (!error.empty()) {
+    throw ParsingException(error);
+  }
+  
+  // 3. The results of the chunks are combined in their order, after
+  // the value the variable had before the loop, if any.
+  for (size_t i = 0; i < loop->reductions.size(); i++) {
+    const ParallelLoop::Reduction& reduction = loop->reductions[i];
+    Variable result;
+    GetVarFunction* var = dynamic_cast<GetVarFunction*>(
+                            ParserFunction::getFunction(reduction.name));
+    if (var != nullptr) {
+      result = var->getValue();
+    }
+    for (size_t chunk = 0; chunk < loop->chunks; chunk++) {
+      ParallelLoop::combine(result, loop->partials[chunk][i], reduction.type);
+    }
+    GetVarFunction::setVariable(reduction.name, result);
+  }
+  
+  script.setPointer(blockStart);
+  skipBlock(script);
+  return Variable::emptyInstance;
+}
+
+void Interpreter::readReductions(ParsingScript& script, ParallelLoop& loop)
+{
+  // Looks like: "reduce(sum : total, max : biggest)".
+  const string& data = script.getData();
+  size_t from = script.getPointer();
+  if (data.compare(from, Constants::REDUCE.size(), Constants::REDUCE) != 0 ||
+      from + Constants::REDUCE.size() >= data.size() ||
+      data[from + Constants::REDUCE.size()] != Constants::START_ARG) {
+    return;
+  }
+  script.forward(Constants::REDUCE.size() + 1);
+  string clause = Utils::getBodyBetween(script, Constants::START_ARG, Constants::END_ARG);
+  script.forward();
+  
+  size_t start = 0;
+  while (start < clause.size()) {
+    size_t end = clause.find(Constants::NEXT_ARG, start);
+    end = end == string::npos ? clause.size() : end;
+    string item = clause.substr(start, end - start);
+    start = end + 1;
+    
+    size_t colon = item.find(Constants::FOR_ANY);
+    string type = Utils::trim(item.substr(0, colon));
+    string name = colon == string::npos ? "" : Utils::trim(item.substr(colon + 1));
+    if (name.empty()) {
+      throw ParsingException("Expecting: " + Constants::REDUCE + "(" +
+                             Constants::REDUCE_SUM + " : variable, ...)");
+    }
+    
+    ParallelLoop::Reduction reduction;
+    reduction.name = name;
+    if (type == Constants::REDUCE_SUM) {
+      reduction.type = ParallelLoop::SUM;
+    } else if (type == Constants::REDUCE_MIN) {
+      reduction.type = ParallelLoop::MIN;
+    } else if (type == Constants::REDUCE_MAX) {
+      reduction.type = ParallelLoop::MAX;
+    } else if (type == Constants::REDUCE_APPEND) {
+      reduction.type = ParallelLoop::APPEND;
+    } else {
+      throw ParsingException("Unknown reduction [" + type + "]");
+    }
+    loop.reductions.push_back(reduction);
+  }
+}
+
+void Interpreter::readCounterValues(ParsingScript& script, const string& forString,
+                                    size_t headerStart, ParallelLoop& loop)
+{
+  // The header is the same as of the canonical for-loop, the counter is
+  // the variable assigned in its first part.
+  shared_ptr<ForLoop> forLoop = getForLoop(script, forString, headerStart);
+  
+  ParsingScript initScript = forLoop->getScript(ForLoop::INIT);
+  ParsingScript condScript = forLoop->getScript(ForLoop::CONDITION);
+  ParsingScript loopScript = forLoop->getScript(ForLoop::STEP);
+  
+  size_t assign = initScript.getData().find(Constants::ASSIGN);
+  loop.varName = assign == string::npos ? "" :
+                 Utils::trim(initScript.getData().substr(0, assign));
+  if (loop.varName.empty()) {
+    throw ParsingException("Expecting: " + Constants::PARALLEL_FOR +
+                           "(i = start; condition; step)");
+  }
+  
+  initScript.execute();
+  
+  int cycles = 0;
+  while (checkForCondition(*forLoop, condScript)) {
+    if (++cycles >= Constants::MAX_LOOPS) {
+      throw ParsingException("Looks like an infinite loop after " +
+                             to_string(cycles) + " cycles.");
+    }
+    GetVarFunction* counter = dynamic_cast<GetVarFunction*>(
+                                ParserFunction::getFunction(loop.varName));
+    Utils::checkNotNull(loop.varName, counter);
+    loop.values.push_back(counter->getValue());
+    
+    doForStep(*forLoop, loopScript);
+  }
+}
+
+void Interpreter::runParallelChunks(ParallelLoop& loop)
+{
+  const shared_ptr<ScriptCache>& cache = loop.body.getCache();
+  const LocalSlots* slots = cache ? cache->getSlots() : nullptr;
+  
+  while (!loop.failed) {
+    size_t chunk = loop.nextChunk++;
+    if (chunk >= loop.chunks) {
+      return;
+    }
+    
+    // Every chunk has a stack level of its own: the variables assigned
+    // in it, including the reductions, are private to it.
+    ParserFunction::addStackLevel(Constants::PARALLEL_FOR, slots);
+    try {
+      for (size_t i = 0; i < loop.locals.size(); i++) {
+        GetVarFunction::setVariable(loop.locals[i].first, loop.locals[i].second);
+      }
+      for (size_t i = 0; i < loop.reductions.size(); i++) {
+        GetVarFunction::setVariable(loop.reductions[i].name,
+                                    ParallelLoop::identity(loop.reductions[i].type));
+      }
+      
+      ParsingScript script(loop.body);
+      script.setCache(cache);
+      size_t from = chunk * loop.chunkSize;
+      size_t to = min(from + loop.chunkSize, loop.values.size());
+      for (size_t i = from; i < to; i++) {
+        script.setPointer(loop.body.getPointer());
+        GetVarFunction::setVariable(loop.varName, loop.values[i]);
+        Variable result = processBlock(script);
+        if (result.isReturn || result.type == Constants::BREAK_STATEMENT) {
+          throw ParsingException("Can't break out of " + Constants::PARALLEL_FOR);
+        }
+      }
+      
+      vector<Variable>& partials = loop.partials[chunk];
+      for (size_t i = 0; i < loop.reductions.size(); i++) {
+        GetVarFunction* var = dynamic_cast<GetVarFunction*>(
+                                ParserFunction::getVariable(loop.reductions[i].name));
+        partials.push_back(var != nullptr ? var->getValue() : Variable::emptyInstance);
+      }
+    } catch (...) {
+      loop.failed = true;
+      ParserFunction::popLocalVariables();
+      throw;
+    }
+    ParserFunction::popLocalVariables();
   }
 }
 
@@ -266,7 +651,9 @@ Variable Interpreter::processWhile(ParsingScript& script)
   while (stillValid) {
     script.setPointer(startWhileCondition);
     
-    result = Parser::loadAndCalculate(script, Constants::END_ARG_STR);
+    if (!runBytecode(script, result, Constants::END_ARG)) {
+      result = Parser::loadAndCalculate(script, Constants::END_ARG_STR);
+    }
     bool stillValid = result.numValue != 0;
     
     if (!stillValid) {
@@ -307,7 +694,7 @@ Variable Interpreter::processTry(ParsingScript& script)
     exception = exc;
   }
   
-  if (!exception.msg().empty() ||
+  if (!exception.empty() ||
       result.type == Constants::BREAK_STATEMENT) {
     // Got here from the middle of the try-block either because
     // an exception was thrown or because of a Break. Skip it.
@@ -328,14 +715,16 @@ Variable Interpreter::processTry(ParsingScript& script)
   string exceptionName = Utils::getNextToken(script);
   script.forward(); // skip closing parenthesis
   
-  if (!exception.msg().empty()) {
+  if (!exception.empty()) {
     string excStack = ParserFunction::invalidateStacksAfterLevel(currentStackLevel);
     if (!excStack.empty()) {
       excStack = " --> " + exceptionName + excStack;
     }
     
-    GetVarFunction* excFunc =
-    new GetVarFunction(Variable(exception.msg() + excStack));
+    // The message is made only if the catch block looks at it.
+    GetVarFunction* excFunc = new GetVarFunction([=]() {
+      return Variable(exception.msg() + excStack);
+    });
     ParserFunction::addGlobalOrLocalVariable(exceptionName, excFunc);
     
  	  result = processBlock(script);
@@ -363,7 +752,12 @@ Variable Interpreter::processBlock(ParsingScript& script)
                              script.substr(blockStart) + "]");
     }
     
-    result = Parser::loadAndCalculate(script, Constants::END_PARSING_STR);
+    // The previous result may share the elements of an array changed by
+    // this statement. Releasing it spares copying the array.
+    result = Variable::emptyInstance;
+    if (!runBytecode(script, result)) {
+      result = Parser::loadAndCalculate(script, Constants::END_PARSING_STR);
+    }
     
     if (result.type == Constants::BREAK_STATEMENT ||
         result.type == Constants::CONTINUE_STATEMENT) {
@@ -376,6 +770,17 @@ Variable Interpreter::processBlock(ParsingScript& script)
 void Interpreter::skipBlock(ParsingScript& script)
 {
   size_t blockStart = script.getPointer();
+  
+  // The block starts with the next '{': jump to its end if it's known.
+  size_t groupStart = script.find_first_of("{}", blockStart);
+  if (groupStart != string::npos && script(groupStart) == Constants::START_GROUP) {
+    size_t groupEnd = script.findMatch(groupStart);
+    if (groupEnd != string::npos) {
+      script.setPointer(groupEnd + 1);
+      return;
+    }
+  }
+  
   int startCount = 0;
   int endCount = 0;
   while (startCount == 0 || startCount > endCount) {
@@ -404,13 +809,13 @@ void Interpreter::skipBlock(ParsingScript& script)
 void Interpreter::skipRestBlocks(ParsingScript& script)
 {
   while (script.stillValid()) {
-    ParsingScript nextData(script);
-    string nextToken = Utils::getNextToken(nextData);
+    size_t start = script.getPointer();
+    string nextToken = Utils::getNextToken(script);
     if (Constants::ELSE_IF_LIST.find(nextToken) == Constants::ELSE_IF_LIST.end() &&
         Constants::ELSE_LIST.find(nextToken) == Constants::ELSE_LIST.end()) {
+      script.setPointer(start);
       return;
     }
-    script.setPointer(nextData.getPointer());
     skipBlock(script);
   }
 }
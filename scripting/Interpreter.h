@@ -11,6 +11,8 @@
 
 #include "Utils.h"
 
+class ForLoop;
+
 class Interpreter
 {
 public:
@@ -19,19 +21,43 @@ public:
     static Variable process(const string& scriptData);
 
     static Variable processFor(ParsingScript& script);
+    // "parallel_for(item : array)" or "parallel_for(i = 0; i < n; i++)",
+    // optionally followed by "reduce(sum : total, ...)".
+    static Variable processParallelFor(ParsingScript& script);
     static Variable processIf(ParsingScript& script);
     static Variable processTry(ParsingScript& script);
     static Variable processWhile(ParsingScript& script);
   
+    // Executes the statement (or the expression ending with the terminator)
+    // at the current script position with the Bytecode, if it is enabled.
+    // Returns false if the Parser must be used instead.
+    static bool runBytecode(ParsingScript& script, Variable& result,
+                            char terminator = Constants::NULL_CHAR);
+  
+    static void useBytecode(bool useIt) { s_useBytecode = useIt; }
+  
 private:
     static Variable processBlock(ParsingScript& script);
     static void skipBlock(ParsingScript& script);
     static void skipRestBlocks(ParsingScript& script);
   
     static void processArrayFor(ParsingScript& script, const string& forString);
-    static void processCanonicalFor(ParsingScript& script, const string& forString);
+    static void processCanonicalFor(ParsingScript& script, const string& forString,
+                                    size_t headerStart);
+    static shared_ptr<ForLoop> getForLoop(ParsingScript& script, const string& forString,
+                                          size_t headerStart);
+    static bool checkForCondition(const ForLoop& loop, ParsingScript& condScript);
+    static void doForStep(const ForLoop& loop, ParsingScript& stepScript);
+  
+    struct ParallelLoop;
+    static void readReductions(ParsingScript& script, ParallelLoop& loop);
+    static void readCounterValues(ParsingScript& script, const string& forString,
+                                  size_t headerStart, ParallelLoop& loop);
+    static void runParallelChunks(ParallelLoop& loop);
   
     static void readConfig(const string& configFileName);
+  
+    static bool s_useBytecode;
 };
 
 #endif /* Interpreter_h */
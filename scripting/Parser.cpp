@@ -14,86 +14,83 @@
 #include <ctype.h>
 
 
+vector<Parser::Cell>& Parser::getCells()
+{
+  static thread_local vector<Cell> cells;
+  return cells;
+}
+
 Variable Parser::loadAndCalculate(ParsingScript& script,
                                   const string& to)
 {
-  vector<Variable> listToMerge = split(script, to);
+  // The cells of this expression are on top of the cells of the expressions
+  // being calculated, from base on. They are popped when leaving, also if
+  // there is an exception.
+  vector<Cell>& cells = getCells();
+  struct Frame {
+    vector<Cell>& cells;
+    size_t base;
+    ~Frame() { cells.erase(cells.begin() + base, cells.end()); }
+  } frame{cells, cells.size()};
   
-  if (listToMerge.empty()) {
+  split(script, to, frame.base);
+  size_t count = cells.size() - frame.base;
+  
+  if (count == 0) {
     throw ParsingException("Couldn't parse [" +
                            script.rest() + "]");
   }
   
   // If there is just one resulting cell there is no need
   // to perform the second step to merge tokens.
-  if (listToMerge.size() == 1) {
-    return listToMerge[0];
+  if (count == 1) {
+    return std::move(cells[frame.base].value);
   }
   
-  Variable& baseCell = listToMerge[0];
-  size_t index = 1;
+  Cell& baseCell = cells[frame.base];
+  size_t index = frame.base + 1;
   
   // Second step: merge list of cells to get the result of an expression.
-  Variable result = merge(baseCell, index, listToMerge);
-  return result;
+  return std::move(merge(baseCell, index, cells));
 }
 
-vector<Variable> Parser::split(ParsingScript& script,
-                               const string& to)
+void Parser::split(ParsingScript& script, const string& to, size_t base)
 {
-  vector<Variable> listToMerge;
+  vector<Cell>& listToMerge = getCells();
   
   if (!script.stillValid() || Utils::contains(to, script.current())) {
     script.forward();
     listToMerge.emplace_back(Variable::emptyInstance);
-    return listToMerge;
+    return;
   }
   
-  string parsingItem;
   int negated = 0;
   bool inQuotes = false;
   int indexDepth = 0;
+  ScriptToken scratch;
   
   do
   { // Main processing cycle of the first part.
-    string negateSymbol = Utils::isNotSign(script.rest());
-    if (!negateSymbol.empty()) {
-      negated++;
-      script.forward(negateSymbol.size());
-      continue;
-    }
-    
-    char ch = script.currentAndForward();
-    checkQuotesIndices(script, ch, inQuotes, indexDepth);
-    
-    string action = Constants::EMPTY;
-    
-    bool keepCollecting = inQuotes || indexDepth > 0 ||
-              stillCollecting(script, parsingItem, to, action);
-    if (keepCollecting)
-    { // The char still belongs to the previous operand.
-      parsingItem += ch;
-      
-      bool goForMore = script.stillValid() &&
-        (inQuotes || indexDepth > 0 || !Utils::contains(to, script.current()));
-      
-      if (goForMore) {
-        continue;
-      }
+    const ScriptToken& token = extractToken(script, to, inQuotes, indexDepth, scratch);
+    negated   += token.negated;
+    inQuotes   = token.inQuotes;
+    indexDepth = token.indexDepth;
+    if (!token.complete) {
+      break;
     }
     
-    checkConsistency(script, parsingItem, listToMerge);
+    const string& parsingItem = token.item;
+    char ch = token.ch;
+    string action = token.action;
+    Constants::Operator op = token.op;
     
-    Utils::moveForwardIf(script, Constants::SPACE);
-    
-    if (action.size() > 1) {
-      script.forward(action.size() - 1);
-    }
+    checkConsistency(script, parsingItem, listToMerge.size() > base);
     
     // We are done getting the next token. The getValue() call below may
     // recursively call loadAndCalculate(). This will happen if extracted
     // item is a function or if the next item is starting with a START_ARG '('.
-    ParserFunction func(script, parsingItem, ch, action);
+    ParserFunction func(script, parsingItem, ch, action, token.slot,
+                        token.symbol, token.actionSymbol);
     Variable current = func.getValue(script);
     
     if (negated > 0 && current.getType() == Constants::NUMBER) {
@@ -106,12 +103,13 @@ vector<Variable> Parser::split(ParsingScript& script,
     
     if (action.empty()) {
       action = updateAction(script, to);
+      op = Constants::toOperator(action);
     } else {
       Utils::moveForwardIf(script, action[0]);
     }
     
     char next = script.tryCurrent(); // we've already moved forward
-    bool done = listToMerge.empty() && (next == Constants::END_STATEMENT ||
+    bool done = listToMerge.size() == base && (next == Constants::END_STATEMENT ||
         (action == Constants::NULL_ACTION && current.getType() != Constants::NUMBER));
     if (done) {
       // If there is no numerical result, we are not in a math expression.
@@ -119,23 +117,109 @@ vector<Variable> Parser::split(ParsingScript& script,
         throw ParsingException("Action [" +
                                action + "] without an argument.");
       }
-      listToMerge.emplace_back(current);
-      return listToMerge;
+      listToMerge.emplace_back(std::move(current));
+      return;
     }
     
-    current.action = action;
-    updateIfBool(script, current);
-    
-    listToMerge.emplace_back(current);
-    parsingItem.clear();
+    listToMerge.emplace_back(std::move(current), op);
+    updateIfBool(script, listToMerge.back());
     
   } while (script.stillValid() &&
           (inQuotes || indexDepth > 0 || !Utils::contains(to, script.current())));
   
   // This happens when called recursively inside of the math expression:
   Utils::moveForwardIf(script, Constants::END_ARG);
+}
+
+const ScriptToken& Parser::extractToken(ParsingScript& script, const string& to,
+                                        bool inQuotes, int indexDepth,
+                                        ScriptToken& scratch)
+{
+  size_t from = script.getPointer();
+  ScriptCache* cache = script.getCache().get();
+  
+  // Only tokens starting outside of quotes and indices are cached: these
+  // are all of them, except for some malformed expressions.
+  bool cacheable = cache != nullptr && !inQuotes && indexDepth == 0;
+  if (cacheable) {
+    const ScriptToken* cached = cache->find(from, to);
+    if (cached != nullptr) {
+      script.setPointer(cached->end);
+      return *cached;
+    }
+  }
+  
+  ScriptToken& token = scratch;
+  token.reset();
+  
+  while (true)
+  {
+    string negateSymbol = Utils::isNotSign(script.getData(), script.getPointer());
+    if (!negateSymbol.empty()) {
+      token.negated++;
+      script.forward(negateSymbol.size());
+      
+      bool goForMore = script.stillValid() &&
+        (inQuotes || indexDepth > 0 || !Utils::contains(to, script.current()));
+      if (!goForMore) { // Nothing left after the NOT sign.
+        token.complete = false;
+        break;
+      }
+      continue;
+    }
+    
+    char ch = script.currentAndForward();
+    checkQuotesIndices(script, ch, inQuotes, indexDepth);
+    
+    string action = Constants::EMPTY;
+    
+    bool keepCollecting = inQuotes || indexDepth > 0 ||
+              stillCollecting(script, token.item, to, action);
+    if (keepCollecting)
+    { // The char still belongs to the previous operand.
+      token.item += ch;
+      
+      bool goForMore = script.stillValid() &&
+        (inQuotes || indexDepth > 0 || !Utils::contains(to, script.current()));
+      
+      if (goForMore) {
+        continue;
+      }
+    }
+    
+    Utils::moveForwardIf(script, Constants::SPACE);
+    
+    if (action.size() > 1) {
+      script.forward(action.size() - 1);
+    }
+    
+    token.ch = ch;
+    token.action = action;
+    token.op = Constants::toOperator(action);
+    break;
+  }
   
-  return listToMerge;
+  token.to = to;
+  token.end = script.getPointer();
+  token.inQuotes = inQuotes;
+  token.indexDepth = indexDepth;
+  
+  if (!cacheable) {
+    return token;
+  }
+  // Items that can't be names (numbers and strings) are not interned.
+  if (!token.item.empty() && !isdigit((unsigned char)token.item[0]) &&
+      token.item[0] != Constants::QUOTE) {
+    token.symbol = Symbols::intern(token.item);
+  }
+  if (!token.action.empty()) {
+    token.actionSymbol = Symbols::intern(token.action);
+  }
+  const LocalSlots* slots = cache->getSlots();
+  if (slots != nullptr && token.symbol != Symbols::NONE) {
+    token.slot = slots->find(token.symbol);
+  }
+  return *cache->add(from, token);
 }
 
 bool Parser::stillCollecting(const ParsingScript& script,
@@ -168,8 +252,7 @@ bool Parser::stillCollecting(const ParsingScript& script,
   
   // Otherwise, if it's an action (+, -, *, etc.) or a space
   // we're done collecting current token.
-  ParsingScript tempScript(script.getData(), script.getPointer() - 1);
-  action = Utils::getValidAction(tempScript);
+  action = Utils::getValidAction(script.getData(), script.getPointer() - 1);
   
   if (action != Constants::EMPTY ||
      (item.size() > 0 && ch == Constants::SPACE)) {    
@@ -209,9 +292,9 @@ void Parser::checkQuotesIndices(const ParsingScript& script,
 
 void Parser::checkConsistency(const ParsingScript& script,
                               const string& item,
-                              const vector<Variable>& listToMerge)
+                              bool inExpression)
 {
-  if (listToMerge.empty()) {
+  if (!inExpression) {
     return;
   }
   
@@ -225,13 +308,13 @@ void Parser::checkConsistency(const ParsingScript& script,
   }
 }
 
-void Parser::updateIfBool(ParsingScript& script, Variable& current)
+void Parser::updateIfBool(ParsingScript& script, Cell& current)
 {
-  if ((current.action == "&&" && current.numValue == 0) ||
-      (current.action == "||" && current.numValue != 0)) {
+  if ((current.action == Constants::AND && current.value.numValue == 0) ||
+      (current.action == Constants::OR  && current.value.numValue != 0)) {
     // Short circuit evaluation: don't need to evaluate more.
     Utils::skipRestExpr(script);
-    current.action = Constants::NULL_ACTION;
+    current.action = Constants::NULL_OPERATOR;
   }
 }
 
@@ -244,32 +327,18 @@ string Parser::updateAction(ParsingScript& script, const string& to)
     return Constants::NULL_ACTION;
   }
   
-  //size_t index = script.getPointer();
-  ParsingScript tempScript(script.getData(), script.getPointer());
-  string action = Utils::getValidAction(tempScript);
-  
-  /*while (action.empty() && tempScript.stillValid() &&
-         tempScript(index) == Constants::END_ARG) {
-    // Look for the next character in string until a valid action is found.
-    tempScript.forward();
-    action = Utils::getValidAction(tempScript);
-  }*/
-  
-  // We need to advance forward not only the action length but also all
-  // the characters we skipped before getting the action.
-  size_t advance = action.empty() ? 0 :
-    action.size() + (tempScript.getPointer() - script.getPointer());
-  script.forward(advance);
+  string action = Utils::getValidAction(script.getData(), script.getPointer());
+  script.forward(action.size());
   return action.empty() ? Constants::NULL_ACTION : action;
 }
 
-Variable Parser::merge(Variable& current, size_t& index,
-                       vector<Variable>& listToMerge,
-                       bool mergeOneOnly)
+Variable& Parser::merge(Cell& current, size_t& index,
+                        vector<Cell>& listToMerge,
+                        bool mergeOneOnly)
 {
   while (index < listToMerge.size())
   {
-    Variable& next = listToMerge[index++];
+    Cell& next = listToMerge[index++];
     
     while (!current.canMergeWith(next))
     { // If we cannot merge cells yet, go to the next cell and merge
@@ -278,11 +347,12 @@ Variable Parser::merge(Variable& current, size_t& index,
       merge(next, index, listToMerge, true /* mergeOneOnly */);
     }
     
-    current.merge(next);
+    current.value.merge(next.value, current.action);
+    current.action = next.action;
     if (mergeOneOnly) {
       break;
     }
   }
   
-  return current;
+  return current.value;
 }
@@ -22,12 +22,37 @@ public:
                                    const string& to);
   
 private:
-  static vector<Variable> split(ParsingScript& script,
-                                const string& to);
+  // An operand of an expression with the action following it,
+  // e.g. "2 *" in "1 + 2 * 3".
+  struct Cell
+  {
+    Cell(Variable val, Constants::Operator op = Constants::NULL_OPERATOR) :
+      value(std::move(val)), action(op) {}
+    
+    bool canMergeWith(const Cell& right) const {
+      return Constants::getPriority(action) >=
+             Constants::getPriority(right.action);
+    }
+    
+    Variable            value;
+    Constants::Operator action;
+  };
+  
+  // The evaluation stack of the thread: the cells of all the expressions
+  // being calculated, so its capacity is reused by all of them.
+  static vector<Cell>& getCells();
+  
+  // Adds the cells of the expression on top of the evaluation stack,
+  // the cells from base on belong to the expression.
+  static void split(ParsingScript& script, const string& to, size_t base);
+  
+  static const ScriptToken& extractToken(ParsingScript& script, const string& to,
+                                         bool inQuotes, int indexDepth,
+                                         ScriptToken& scratch);
   
   static void checkConsistency(const ParsingScript& script,
                                const string& item,
-                               const vector<Variable>& listToMerge);
+                               bool inExpression);
   
   static bool stillCollecting(const ParsingScript& script,
                               const string& item, const string& to, string& action);
@@ -35,13 +60,13 @@ private:
   static void checkQuotesIndices(const ParsingScript& script,
                                  char ch, bool& inQuotes, int& indexDepth);
   
-  static Variable merge(Variable& current, size_t& index,
-                        vector<Variable>& listToMerge,
-                        bool mergeOneOnly = false);
+  static Variable& merge(Cell& current, size_t& index,
+                         vector<Cell>& listToMerge,
+                         bool mergeOneOnly = false);
   
   static string updateAction(ParsingScript& script, const string& to);
   
-  static void updateIfBool(ParsingScript& script, Variable& current);
+  static void updateIfBool(ParsingScript& script, Cell& current);
   
 };
 
@@ -17,16 +17,22 @@
 ParserFunctionMap ParserFunction::s_functions;
 ParserFunctionMap ParserFunction::s_globals;
 ActionFunctionMap ParserFunction::s_actions;
-stack<ParserFunction::StackLevel> ParserFunction::s_locals;
+mutex ParserFunction::s_mutex;
+size_t ParserFunction::s_maxStackLevels = Constants::MAX_STACK_LEVELS;
 
-StringOrNumberFunction* ParserFunction::s_strOrNumFunction =
-new StringOrNumberFunction();
 IdentityFunction*       ParserFunction::s_idFunction =
 new IdentityFunction();
 
+StringOrNumberFunction& ParserFunction::getStrOrNumFunction()
+{
+  static thread_local StringOrNumberFunction strOrNumFunction;
+  return strOrNumFunction;
+}
+
 // A "virtual" Constructor
 ParserFunction::ParserFunction(ParsingScript& script,
-                               const string& item, char ch, string& action) :
+                               const string& item, char ch, string& action,
+                               int slot, int symbol, int actionSymbol) :
                                m_newInstance(false)
 {
   if (item.empty() && (ch == Constants::START_ARG || !script.stillValid())) {
@@ -35,31 +41,39 @@ ParserFunction::ParserFunction(ParsingScript& script,
     return;
   }
   
-  m_impl = getRegisteredAction(item, action);
+  m_impl = getRegisteredAction(item, action, actionSymbol);
   if (m_impl != 0) {
     return;
   }
   
+  if (slot >= 0) {
+    const LocalSlots* slots = script.getCache()->getSlots();
+    m_impl = getLocalVariable(slots, slot);
+    if (m_impl != 0) {
+      return;
+    }
+  }
+  
   // Is this an array element?
   m_impl = getArrayFunction(item, script, action);
   if (m_impl != 0) {
     return;
   }
   
-  m_impl = getFunction(item);
+  m_impl = getFunction(symbol != Symbols::NONE ? symbol : Symbols::find(item));
   if (m_impl != 0) {
     return;
   }
   
-  if (m_impl == s_strOrNumFunction && item.empty())  {
+  if (m_impl == &getStrOrNumFunction() && item.empty())  {
     string problem = !action.empty() ? action : string(1, ch);
     string restData = string(1, ch) + script.rest();
     throw ParsingException("Couldn't parse [" + problem + "] in " + restData + "...");
   }
 
   // Function not found, will try to parse this as a string in quotes or a number.
-  m_impl = s_strOrNumFunction;
-  s_strOrNumFunction->setItem(item);
+  m_impl = &getStrOrNumFunction();
+  getStrOrNumFunction().setItem(item);
 }
 
 ParserFunction::~ParserFunction()
@@ -100,35 +114,47 @@ ParserFunction* ParserFunction::getArrayFunction(const string& name,
   script.backward(action.size());
   delta -= arrayName.size();
   
-  varFunc->setIndices(arrayIndices);
-  varFunc->setDelta(delta);
-  return varFunc;
+  return new ArrayElementFunction(varFunc, arrayIndices, delta);
 }
 
-ParserFunction* ParserFunction::getFunction(const string& name, bool& isGlobal)
+ParserFunction* ParserFunction::getFunction(int symbol, bool& isGlobal)
 {
+  if (symbol == Symbols::NONE) {
+    // Nothing was ever registered with this name.
+    isGlobal = true;
+    return 0;
+  }
+  
   // First search among local variables.
-  if (!s_locals.empty()) {
-    isGlobal = false;;
-    const StackLevel& level = s_locals.top();
-    const ParserFunctionMap& locals = level.variables;
-    
-    auto it = locals.find(name);
-    if (it != locals.end()) {
-      return it->second;
+  stack<StackLevel>& locals = getContext().locals;
+  if (!locals.empty()) {
+    isGlobal = false;
+    StackLevel& level = locals.top();
+    int slot = level.slots != nullptr ? level.slots->find(symbol) : -1;
+    if (slot >= 0) {
+      ParserFunction* local = level.getSlot(slot);
+      if (local != 0) {
+        return local;
+      }
+    } else {
+      auto it = level.variables.find(symbol);
+      if (it != level.variables.end()) {
+        return it->second;
+      }
     }
   }
   
   isGlobal = true;
+  SharedLock lock(s_mutex);
   
   // Check if a global variable exists
-  auto it = s_globals.find(name);
+  auto it = s_globals.find(symbol);
   if (it != s_globals.end()) {
     return it->second;
   }
   
   // Check if a global function exists and is registered (e.g. pi, exp)
-  it = s_functions.find(name);
+  it = s_functions.find(symbol);
   if (it != s_functions.end()) {
     return it->second;
   }
@@ -137,9 +163,14 @@ ParserFunction* ParserFunction::getFunction(const string& name, bool& isGlobal)
 }
 
 ActionFunction* ParserFunction::getRegisteredAction(const string& name,
-                                                    string& action)
+                                                    string& action,
+                                                    int actionSymbol)
 {
-  ActionFunction* actionFunction = getAction(action);
+  if (action.empty()) {
+    return 0;
+  }
+  ActionFunction* actionFunction = getAction(actionSymbol != Symbols::NONE ?
+                                             actionSymbol : Symbols::find(action));
   if (actionFunction == 0) {
     return 0;
   }
@@ -153,13 +184,13 @@ ActionFunction* ParserFunction::getRegisteredAction(const string& name,
   return theAction;
 }
 
-ActionFunction* ParserFunction::getAction(const string& action)
+ActionFunction* ParserFunction::getAction(int symbol)
 {
-  if (action.empty()) {
+  if (symbol == Symbols::NONE) {
     return 0;
   }
   
-  auto it = s_actions.find(action);
+  auto it = s_actions.find(symbol);
   if (it == s_actions.end()) {
     return 0;
   }
@@ -169,12 +200,13 @@ ActionFunction* ParserFunction::getAction(const string& action)
 
 void ParserFunction::addAction(const string& name, ActionFunction* action)
 {
-  s_actions[name] = action;
+  s_actions[Symbols::intern(name)] = action;
 }
 
 void ParserFunction::addGlobalFunction(const string& name, ParserFunction* function,
                                        bool isNative)
 {
+  SharedLock lock(s_mutex);
   add(s_functions, function, name, isNative);
 }
 
@@ -183,7 +215,7 @@ void ParserFunction::addGlobalOrLocalVariable(const string& name,
                                               bool onlyGlobal)
 {
   
-  if (!onlyGlobal && !s_locals.empty()) {
+  if (!onlyGlobal && !getContext().locals.empty()) {
     var->setName(name);
     addLocalVariable(var);
   } else {
@@ -191,31 +223,96 @@ void ParserFunction::addGlobalOrLocalVariable(const string& name,
   }
 }
 
+ParserFunction* ParserFunction::getVariable(int symbol, bool onlyGlobal)
+{
+  if (symbol == Symbols::NONE) {
+    return 0;
+  }
+  stack<StackLevel>& locals = getContext().locals;
+  if (!onlyGlobal && !locals.empty()) {
+    StackLevel& level = locals.top();
+    int slot = level.slots != nullptr ? level.slots->find(symbol) : -1;
+    if (slot >= 0) {
+      return level.getSlot(slot);
+    }
+    auto it = level.variables.find(symbol);
+    return it != level.variables.end() ? it->second : 0;
+  }
+  
+  SharedLock lock(s_mutex);
+  auto it = s_globals.find(symbol);
+  return it != s_globals.end() ? it->second : 0;
+}
+
 void ParserFunction::addGlobalVariable(const string& name, ParserFunction* var)
 {
+  SharedLock lock(s_mutex);
   add(s_globals, var, name, false);
 }
 
 void ParserFunction::addLocalVariable(ParserFunction* local)
 {
-  if (s_locals.empty()) {
-    s_locals.emplace();
+  stack<StackLevel>& locals = getContext().locals;
+  if (locals.empty()) {
+    locals.emplace();
   }
   local->setGlobal(false);
   
-  ParserFunctionMap& topStack = s_locals.top().variables;
+  StackLevel& level = locals.top();
+  int slot = level.slots != nullptr ? level.slots->find(local->getName()) : -1;
+  if (slot >= 0) {
+    setLocalVariable(level.slots, slot, local);
+    return;
+  }
+  
+  ParserFunctionMap& topStack = level.variables;
   add(topStack, local, local->getName(), false);
 }
 
+ParserFunction* ParserFunction::getLocalVariable(const LocalSlots* slots, int slot)
+{
+  stack<StackLevel>& locals = getContext().locals;
+  if (locals.empty() || locals.top().slots != slots) {
+    return 0;
+  }
+  return locals.top().getSlot(slot);
+}
+
+bool ParserFunction::setLocalVariable(const LocalSlots* slots, int slot,
+                                      ParserFunction* local)
+{
+  stack<StackLevel>& locals = getContext().locals;
+  if (locals.empty() || locals.top().slots != slots) {
+    return false;
+  }
+  
+  // Same as add() for the other variables.
+  const string& name = slots->names[slot];
+  if (local->getName().empty()) {
+    local->setName(name);
+  }
+  local->setNative(false);
+  local->setGlobal(false);
+  
+  ParserFunction*& current = locals.top().getSlot(slot);
+  if (current == 0) {
+    Translation::addTempKeyword(Symbols::intern(name));
+  }
+  delete current;
+  current = local;
+  return true;
+}
+
 template <class T, class S>
-void ParserFunction::add(T& container, S& value, const string& key,
+void ParserFunction::add(T& container, S& value, const string& name,
                          bool isNative)
 {
   if (value->getName().empty()) {
-    value->setName(key);
+    value->setName(name);
   }
   value->setNative(isNative);
   
+  int key = Symbols::intern(name);
   if (!isNative) {
     Translation::addTempKeyword(key);
   } else {
@@ -226,7 +323,7 @@ void ParserFunction::add(T& container, S& value, const string& key,
   if (!tryInsert.second) {
     // The variable or function already exists.
     if (isNative) {
-      throw ParsingException("Global name [" + key + "] already registered");
+      throw ParsingException("Global name [" + name + "] already registered");
     }
     // Delete it and replace with the new one.
     delete tryInsert.first->second;
@@ -237,7 +334,7 @@ void ParserFunction::add(T& container, S& value, const string& key,
 string ParserFunction::invalidateStacksAfterLevel(size_t level)
 {
   string stackDescr;
-  while (s_locals.size() > level) {
+  while (getContext().locals.size() > level) {
     string stackName = popLocalVariables();
     if (!stackName.empty()) {
       stackDescr += Constants::NEW_LINE + "  " + stackName + "()";
@@ -249,47 +346,92 @@ string ParserFunction::invalidateStacksAfterLevel(size_t level)
 
 string ParserFunction::popLocalVariables()
 {
-  if (s_locals.empty()) {
+  stack<StackLevel>& locals = getContext().locals;
+  if (locals.empty()) {
     return "";
   }
   
-  StackLevel& stLevel = s_locals.top();
+  StackLevel& stLevel = locals.top();
   string stackName = stLevel.name;
   
   stLevel.cleanUp();
-  s_locals.pop();
+  locals.pop();
   
   return stackName;
 }
 
 void ParserFunction::addLocalVariables(StackLevel& locals)
 {
-  s_locals.emplace(locals);
+  getContext().locals.emplace(locals);
 }
 
 void ParserFunction::popLocalVariable(const string& name)
 {
-  if (s_locals.empty()) {
+  stack<StackLevel>& locals = getContext().locals;
+  if (locals.empty()) {
     return;
   }
   
-  s_locals.top().cleanUp(name);
+  locals.top().cleanUp(name);
 }
 
-void ParserFunction::addStackLevel(const string& name)
+void ParserFunction::addStackLevel(const string& name, const LocalSlots* slots)
 {
-  s_locals.emplace(name);
+  // Not more than the stack of the thread can take: a thread started
+  // with less than asked for, see OS::runWithStackSize(), gets less.
+  size_t maxLevels = min(s_maxStackLevels,
+                         OS::getStackSize() / Constants::STACK_PER_LEVEL);
+  Context& context = getContext();
+  if (context.locals.size() >= maxLevels) {
+    throw ParsingException("Stack overflow: more than " +
+                           to_string(maxLevels) +
+                           " nested calls in [" + name + "]");
+  }
+  context.locals.emplace(name);
+  if (slots != nullptr) {
+    StackLevel& level = context.locals.top();
+    level.slots = slots;
+    level.slotBase = context.slots.size();
+    context.slots.resize(context.slots.size() + slots->names.size(), nullptr);
+  }
 }
 
 size_t ParserFunction::getCurrentStackLevel()
 {
-  return s_locals.size();
+  return getContext().locals.size();
+}
+
+vector<pair<string, Variable>> ParserFunction::getLocalValues()
+{
+  vector<pair<string, Variable>> values;
+  stack<StackLevel>& locals = getContext().locals;
+  if (locals.empty()) {
+    return values;
+  }
+  
+  StackLevel& level = locals.top();
+  for (auto it = level.variables.begin(); it != level.variables.end(); ++it) {
+    GetVarFunction* var = dynamic_cast<GetVarFunction*>(it->second);
+    if (var != nullptr) {
+      values.emplace_back(Symbols::name(it->first), var->getValue());
+    }
+  }
+  if (level.slots != nullptr) {
+    for (size_t i = 0; i < level.slots->names.size(); i++) {
+      GetVarFunction* var = dynamic_cast<GetVarFunction*>(level.getSlot((int)i));
+      if (var != nullptr) {
+        values.emplace_back(level.slots->names[i], var->getValue());
+      }
+    }
+  }
+  return values;
 }
 
 void ParserFunction::allFunctions()
 {
   OS::print("*** All available functions ***", true);
 
+  SharedLock lock(s_mutex);
   printVars(s_functions, false);
 
   OS::print(string(40, '*'), true);
@@ -311,13 +453,23 @@ typename ADAPTER::container_type & getContainer (ADAPTER &a)
 void ParserFunction::allVariables()
 {
   OS::print("*** All global variables ***", true);
-  printVars(s_globals);
+  {
+    SharedLock lock(s_mutex);
+    printVars(s_globals);
+  }
   
-  deque<StackLevel>& container = getContainer(s_locals);
+  deque<StackLevel>& container = getContainer(getContext().locals);
   for (auto it = container.begin(); it != container.end(); ++it) {
     StackLevel& st = *it;
     OS::print("*** Local variables of " + st.name + " ***", true);
-    printVars(st.variables);
+    ParserFunctionMap variables(st.variables);
+    for (size_t i = 0; st.slots != nullptr && i < st.slots->names.size(); i++) {
+      ParserFunction* local = st.getSlot((int)i);
+      if (local != 0) {
+        variables[Symbols::intern(st.slots->names[i])] = local;
+      }
+    }
+    printVars(variables);
   }
   
   OS::print(string(40, '*'), true);
@@ -330,7 +482,7 @@ void ParserFunction::printVars(const T& container, bool getValues)
   results.reserve(container.size());
   
   for (auto it = container.begin(); it != container.end(); ++it) {
-    const string& name  = it->first;
+    const string& name  = Symbols::name(it->first);
     
     if (getValues) {
       GetVarFunction* impl = dynamic_cast<GetVarFunction*>(it->second->m_impl);
@@ -358,11 +510,27 @@ void CustomFunction::StackLevel::cleanUp()
     it->second = 0;
   }
   variables.clear();
+  
+  if (slots != nullptr) {
+    vector<ParserFunction*>& all = getContext().slots;
+    for (size_t i = slotBase; i < all.size(); i++) {
+      delete all[i];
+    }
+    all.resize(slotBase);
+  }
 }
 
 void CustomFunction::StackLevel::cleanUp(const string& name)
 {
-  auto it = variables.find(name);
+  int symbol = Symbols::find(name);
+  int slot = slots != nullptr ? slots->find(symbol) : -1;
+  if (slot >= 0) {
+    delete getSlot(slot);
+    getSlot(slot) = 0;
+    return;
+  }
+  
+  auto it = variables.find(symbol);
   if (it != variables.end()) {
     delete it->second;
     variables.erase(it);
@@ -18,8 +18,9 @@ class ActionFunction;
 class StringOrNumberFunction;
 class IdentityFunction;
 
-using ParserFunctionMap = unordered_map<string, ParserFunction*>;
-using ActionFunctionMap = unordered_map<string, ActionFunction*>;
+// Keyed by the interned names, see Symbols.
+using ParserFunctionMap = unordered_map<int, ParserFunction*>;
+using ActionFunctionMap = unordered_map<int, ActionFunction*>;
 
 class ParserFunction
 {
@@ -32,16 +33,48 @@ public:
     void cleanUp(const string& name);
     void cleanUp();
     
+    ParserFunction*& getSlot(int slot)
+    { return getContext().slots[slotBase + slot]; }
+    
     string name;
-    ParserFunctionMap variables;
+    ParserFunctionMap variables; // locals without a slot
+    
+    // The locals with a slot are kept in Context::slots, from slotBase.
+    const LocalSlots* slots = nullptr;
+    size_t slotBase = 0;
   };
   
+  // The state of the interpreter in one thread: the stack of its local
+  // variables. Each script thread starts with an empty one.
+  //
+  // The functions and the global variables are shared by all the threads.
+  // Their tables can be used from any thread, but a shared variable can
+  // only be read by the threads as long as none of them changes it:
+  // assignments to a global variable or its elements from several
+  // threads, as well as redefining a function while the others call it,
+  // must be done inside lock().
+  struct Context
+  {
+    stack<StackLevel> locals;
+    vector<ParserFunction*> slots; // locals of all the stack levels
+  };
+  
+  static Context& getContext()
+  {
+    static thread_local Context context;
+    return context;
+  }
+  
   Variable getValue(ParsingScript& script);
   
   ParserFunction() : m_impl(this), m_newInstance(false) {}
   
+  // If slot is not negative, item is a local variable with this slot
+  // in the current stack level, see LocalSlots. The symbols are the interned
+  // item and action, if known.
   ParserFunction(ParsingScript& script,
-                 const string& item, char ch, string& action);
+                 const string& item, char ch, string& action, int slot = -1,
+                 int symbol = Symbols::NONE, int actionSymbol = Symbols::NONE);
   
   virtual ~ParserFunction();
   
@@ -61,13 +94,20 @@ public:
   void setNewInstance() { m_newInstance = true; }
   bool isNewInstance()  { return m_newInstance; }
   
-  static ActionFunction* getRegisteredAction(const string& name, string& action);
+  static ActionFunction* getRegisteredAction(const string& name, string& action,
+                                             int actionSymbol = Symbols::NONE);
   
   static ParserFunction* getFunction(const string& name)
-  { bool isGlobal = false; return getFunction(name, isGlobal); }
-  static ParserFunction* getFunction(const string& name, bool& isGlobal);
+  { bool isGlobal = false; return getFunction(Symbols::find(name), isGlobal); }
+  static ParserFunction* getFunction(const string& name, bool& isGlobal)
+  { return getFunction(Symbols::find(name), isGlobal); }
+  static ParserFunction* getFunction(int symbol)
+  { bool isGlobal = false; return getFunction(symbol, isGlobal); }
+  static ParserFunction* getFunction(int symbol, bool& isGlobal);
   
-  static ActionFunction* getAction(const string& action);
+  static ActionFunction* getAction(const string& action)
+  { return getAction(Symbols::find(action)); }
+  static ActionFunction* getAction(int symbol);
   
   static ParserFunction* getArrayFunction(const string& name, ParsingScript& script,
                                           const string& action);
@@ -77,6 +117,10 @@ public:
   static void addGlobalOrLocalVariable(const string& name,
                                        ParserFunction* function,
                                        bool onlyGlobal = false);
+  // The variable that addGlobalOrLocalVariable() would replace, if any.
+  static ParserFunction* getVariable(const string& name, bool onlyGlobal = false)
+  { return getVariable(Symbols::find(name), onlyGlobal); }
+  static ParserFunction* getVariable(int symbol, bool onlyGlobal = false);
   static void addGlobalFunction(const string& name, ParserFunction* function,
                                 bool isNative = true);
   static void addGlobalVariable(const string& name, ParserFunction* var);
@@ -84,15 +128,27 @@ public:
   static void addLocalVariable(ParserFunction* local);
   static void addLocalVariables(StackLevel& locals);
   
+  // Access to the local variables by slot, used if the current stack level
+  // has the given slots. Otherwise return null and false respectively.
+  static ParserFunction* getLocalVariable(const LocalSlots* slots, int slot);
+  static bool setLocalVariable(const LocalSlots* slots, int slot,
+                               ParserFunction* local);
+  
   static string invalidateStacksAfterLevel(size_t level);
   static string popLocalVariables();
   static void popLocalVariable(const string& name);
   
-  static void addStackLevel(const string& name);
+  // Throws if there are already too many stack levels.
+  static void addStackLevel(const string& name,
+                            const LocalSlots* slots = nullptr);
   static size_t getCurrentStackLevel();
+  // The names and values of the variables in the current stack level.
+  static vector<pair<string, Variable>> getLocalValues();
+  static void setMaxStackLevels(size_t levels) { s_maxStackLevels = levels; }
+  static size_t getMaxStackLevels()           { return s_maxStackLevels; }
   
   template <class T, class S>
-  static void add(T& container, S& value, const string& key,
+  static void add(T& container, S& value, const string& name,
                   bool isNative = true);
   
   static void allFunctions();
@@ -101,7 +157,7 @@ public:
     static void printVars(const T& container, bool getValues = true);
 
   static const stack<StackLevel>& getExecutionStack()
-  { return s_locals; }
+  { return getContext().locals; }
   
 protected:
   
@@ -122,10 +178,12 @@ private:
   
   static ParserFunctionMap s_functions;
   static ParserFunctionMap s_globals;
-  static ActionFunctionMap s_actions;
-  static stack<StackLevel> s_locals;
+  static ActionFunctionMap s_actions; // only added to by Interpreter::init()
+  static mutex s_mutex; // of s_functions and s_globals
+  static size_t s_maxStackLevels;
   
-  static StringOrNumberFunction* s_strOrNumFunction;
+  // Set to the item to parse, so there is one per thread.
+  static StringOrNumberFunction& getStrOrNumFunction();
   static IdentityFunction*       s_idFunction ;
 };
 
@@ -142,6 +200,65 @@ protected:
   string  m_action;
 };
 
+// Base for the functions that are created and deleted all the time: the
+// variables and the instances of the assignment actions. Their memory comes
+// from a free list of the thread, so a deleted object is reused by the next
+// one instead of going back to malloc.
+template <class T>
+class Pooled
+{
+public:
+  static void* operator new(size_t size)
+  {
+    if (size != sizeof(T)) { // a derived class
+      return ::operator new(size);
+    }
+    Block*& head = getFreeList().head;
+    if (head == nullptr) {
+      return ::operator new(size);
+    }
+    Block* block = head;
+    head = block->next;
+    return block;
+  }
+  static void operator delete(void* ptr, size_t size)
+  {
+    if (ptr == nullptr) {
+      return;
+    }
+    if (size != sizeof(T)) {
+      ::operator delete(ptr);
+      return;
+    }
+    Block* block = static_cast<Block*>(ptr);
+    Block*& head = getFreeList().head;
+    block->next = head;
+    head = block;
+  }
+  
+private:
+  struct Block { Block* next; };
+  
+  struct FreeList
+  {
+    ~FreeList()
+    {
+      while (head != nullptr) {
+        Block* next = head->next;
+        ::operator delete(head);
+        head = next;
+      }
+    }
+    Block* head = nullptr;
+  };
+  
+  static FreeList& getFreeList()
+  {
+    static thread_local FreeList freeList;
+    return freeList;
+  }
+};
+
 
 
 #endif /* ParserFunction_hpp */
@@ -13,80 +13,144 @@
 #include "UtilsOS.h"
 #include "Variable.h"
 
-template <class K, class V>
-vector<K> ParsingScript::getKeys(const unordered_map<K, V>& m)
+atomic<int> SharedLock::s_threads(0);
+
+unordered_map<string, int> Symbols::s_ids;
+deque<string>              Symbols::s_names;
+mutex                      Symbols::s_mutex;
+
+int Symbols::intern(const string& name)
 {
-  vector<K> keys;
-  keys.reserve(m.size());
-  for(auto kv : m) {
-    keys.push_back(kv.first);
+  SharedLock lock(s_mutex);
+  auto tryInsert = s_ids.insert({name, (int)s_names.size()});
+  if (tryInsert.second) {
+    s_names.push_back(name);
   }
-  std::sort(keys.begin(), keys.end());
-  
-  return keys;
+  return tryInsert.first->second;
 }
 
-string ParsingScript::getOriginalLine(size_t& lineNumber) const
+int Symbols::find(const string& name)
 {
-  lineNumber = getOriginalLineNumber();
-  if (lineNumber == string::npos) {
-    return "";
+  SharedLock lock(s_mutex);
+  auto it = s_ids.find(name);
+  return it == s_ids.end() ? NONE : it->second;
+}
+
+const string& Symbols::name(int id)
+{
+  SharedLock lock(s_mutex);
+  return s_names[id];
+}
+
+shared_ptr<ScriptCache> ScriptCache::forThread(const shared_ptr<ScriptCache>& cache)
+{
+  if (!cache || cache->m_owner == this_thread::get_id()) {
+    return cache;
+  }
+  
+  // The original is kept weakly: a new cache may get the address
+  // of a deleted one.
+  struct Copy
+  {
+    weak_ptr<ScriptCache>   original;
+    shared_ptr<ScriptCache> copy;
+  };
+  struct Copies
+  {
+    unordered_map<const ScriptCache*, Copy> entries;
+    size_t pruneAt = 16;
+  };
+  static thread_local Copies copies;
+  
+  // The copies of the deleted caches are dropped whenever there are twice
+  // as many entries as after the last time, so a long running worker
+  // keeps only about as many copies as there are caches in use.
+  if (copies.entries.size() >= copies.pruneAt) {
+    for (auto it = copies.entries.begin(); it != copies.entries.end(); ) {
+      if (it->second.original.expired()) {
+        it = copies.entries.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    copies.pruneAt = max(copies.entries.size() * 2, (size_t)16);
   }
   
-  vector<string> lines = Utils::tokenize(m_originalScript);
-  if (lineNumber < lines.size()) {
-    return lines[lineNumber];
+  Copy& entry = copies.entries[cache.get()];
+  if (entry.copy && entry.original.lock() == cache) {
+    return entry.copy;
   }
   
-  return "";
+  shared_ptr<ScriptCache> copy = make_shared<ScriptCache>();
+  {
+    SharedLock lock(cache->m_mutex);
+    copy->m_tokens   = cache->m_tokens;
+    copy->m_programs = cache->m_programs;
+    copy->m_loops    = cache->m_loops;
+    copy->m_slots    = cache->m_slots;
+  }
+  entry.original = cache;
+  entry.copy = copy;
+  return copy;
 }
 
-size_t ParsingScript::getOriginalLineNumber() const
+size_t LineIndex::getLineNumber(size_t pos) const
 {
-  unordered_map<size_t, size_t>& char2Line = getChar2Line();
   if (char2Line.empty()) {
     return string::npos;
   }
   
-  size_t pos = m_scriptOffset + m_from;
-  vector<size_t> lineStart = getKeys(char2Line);
-  size_t lower = 0;
-  size_t index = lower;
-  
-  if (pos <= lineStart[lower]) { // First line.
-    return char2Line[lineStart[lower]];
+  // The first line ending at or after the position, or the last line.
+  auto it = lower_bound(char2Line.begin(), char2Line.end(), pos,
+                        [](const pair<size_t, size_t>& line, size_t value) {
+                          return line.first < value; });
+  if (it == char2Line.end()) {
+    --it;
   }
-  size_t upper = lineStart.size() - 1;
-  if (pos >= lineStart[upper]) { // Last line.
-    return char2Line[lineStart[upper]];
+  return it->second;
+}
+
+string LineIndex::getLine(const string& original, size_t lineNumber) const
+{
+  if (lineNumber >= lineStarts.size()) {
+    return "";
   }
-  
-  while (lower <= upper) {
-    index = (lower + upper) / 2;
-    size_t guessPos = lineStart[index];
-    if (pos == guessPos) {
-      break;
-    }
-    if (pos < guessPos) {
-      if (index == 0 || pos > lineStart[index - 1]) {
-        break;
-      }
-      upper = index - 1;
-    } else {
-      lower = index + 1;
-    }
+  size_t start = lineStarts[lineNumber];
+  size_t end = lineNumber + 1 < lineStarts.size() ?
+               lineStarts[lineNumber + 1] - 1 : original.size();
+  return original.substr(start, end - start);
+}
+
+string ParsingScript::getOriginalLine(size_t& lineNumber) const
+{
+  lineNumber = getOriginalLineNumber();
+  if (lineNumber == string::npos || !m_source->originalScript) {
+    return "";
   }
   
-  return m_char2Line[lineStart[index]];
+  return m_source->lines->getLine(*m_source->originalScript, lineNumber);
+}
+
+size_t ParsingScript::getOriginalLineNumber() const
+{
+  if (!m_source->lines) {
+    return string::npos;
+  }
+  return m_source->lines->getLineNumber(m_scriptOffset + m_from);
 }
 
 Variable ParsingScript::execute(const string& to)
 {
-  if (m_data.empty()) {
+  if (m_data->empty()) {
     return Variable::emptyInstance;
   }
-  if (m_data[m_data.size() - 1] != Constants::END_STATEMENT) {
-    m_data += Constants::END_STATEMENT;
+  if ((*m_data)[m_data->size() - 1] != Constants::END_STATEMENT) {
+    shared_ptr<ScriptSource> source = make_shared<ScriptSource>(*m_source);
+    source->data += Constants::END_STATEMENT;
+    setSource(source);
+    if (m_cache) { // The cached tokens were extracted from the old data.
+      m_cache = make_shared<ScriptCache>();
+    }
   }
   Variable result = Parser::loadAndCalculate(*this, to);
   return result;
@@ -12,66 +12,286 @@
 #include "Constants.h"
 #include "Variable.h"
 
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// Locks a mutex of the data shared by the script threads (started with
+// thread()), but only while there are such threads: a script running in a
+// single thread doesn't pay for the locking.
+class SharedLock
+{
+public:
+  explicit SharedLock(mutex& m) : m_mutex(s_threads > 0 ? &m : nullptr)
+  { if (m_mutex != nullptr) m_mutex->lock(); }
+  ~SharedLock() { if (m_mutex != nullptr) m_mutex->unlock(); }
+  
+  SharedLock(const SharedLock&) = delete;
+  SharedLock& operator=(const SharedLock&) = delete;
+  
+  // Called before a script thread is started and when it is done.
+  static void addThread()    { s_threads++; }
+  static void removeThread() { s_threads--; }
+  
+private:
+  mutex* m_mutex;
+  static atomic<int> s_threads;
+};
+
+// Identifiers interned into compact ids. The tables of functions, variables
+// and actions are keyed by these ids, so that a name is hashed only once,
+// when the script is parsed, and not at every lookup.
+class Symbols
+{
+public:
+  static const int NONE = -1;
+  
+  // The id of the name, a new one if the name wasn't interned yet.
+  static int intern(const string& name);
+  // The id of the name, NONE if the name was never interned: then there is
+  // nothing keyed by it.
+  static int find(const string& name);
+  
+  static const string& name(int id);
+  
+private:
+  static unordered_map<string, int> s_ids;
+  static deque<string> s_names; // references stay valid when adding
+  static mutex s_mutex;
+};
+
+// A token extracted by Parser::split() starting at a given script position.
+// Extracting it is a pure function of the script text, the start position
+// and the expected terminators, so it can be computed once and replayed.
+struct ScriptToken
+{
+  string to;              // terminators the token was extracted with
+  string item;            // the operand, e.g. "x", "3.14", "foo"
+  string action;          // the action right after the operand, e.g. "+"
+  Constants::Operator op = Constants::NULL_OPERATOR; // parsed action
+  char   ch       = Constants::NULL_CHAR; // last character read
+  int    negated  = 0;    // number of NOT signs consumed
+  size_t end      = 0;    // script pointer after the token
+  bool   complete = true; // false if the expression ended after a NOT sign
+  bool   inQuotes = false;
+  int    indexDepth = 0;
+  int    slot     = -1;   // local variable slot of the item, see LocalSlots
+  int    symbol   = Symbols::NONE; // interned item, if it can be a name
+  int    actionSymbol = Symbols::NONE; // interned action
+  
+  // Same as a new token, but keeps the capacity of the strings.
+  void reset()
+  {
+    to.clear(); item.clear(); action.clear();
+    op = Constants::NULL_OPERATOR;
+    ch = Constants::NULL_CHAR;
+    negated = 0; end = 0;
+    complete = true; inQuotes = false;
+    indexDepth = 0; slot = -1;
+    symbol = actionSymbol = Symbols::NONE;
+  }
+};
+
+// Names of the parameters and of the local variables of a custom function,
+// resolved once when the function is defined. Each name gets a slot in the
+// frame of every call of the function, see ParserFunction::StackLevel.
+struct LocalSlots
+{
+  int find(const string& name) const { return find(Symbols::find(name)); }
+  int find(int symbol) const
+  {
+    auto it = index.find(symbol);
+    return it == index.end() ? -1 : it->second;
+  }
+  int add(const string& name)
+  {
+    auto tryInsert = index.insert({Symbols::intern(name), (int)names.size()});
+    if (tryInsert.second) {
+      names.push_back(name);
+    }
+    return tryInsert.first->second;
+  }
+  
+  vector<string> names;
+  unordered_map<int, int> index; // symbol to slot
+};
+
+class Bytecode;
+class ForLoop;
+
+// Tokens and compiled programs of a script, keyed by their starting position.
+// Shared between all the copies of a script so that loop and function bodies
+// are lexed and compiled only once.
+//
+// Only the thread that created a cache adds to it. The other threads get
+// their own copy of it, see forThread(), so that looking up the tokens
+// doesn't need any locking.
+class ScriptCache
+{
+public:
+  ScriptCache() : m_owner(this_thread::get_id()) {}
+  
+  // The cache itself if it was created by the current thread, otherwise
+  // the copy of the current thread, made on the first call.
+  static shared_ptr<ScriptCache> forThread(const shared_ptr<ScriptCache>& cache);
+  
+  const ScriptToken* find(size_t from, const string& to) const
+  {
+    auto range = m_tokens.equal_range(from);
+    for (auto it = range.first; it != range.second; ++it) {
+      if (it->second.to == to) {
+        return &it->second;
+      }
+    }
+    return nullptr;
+  }
+  
+  // Returned pointers stay valid since the container is node based.
+  const ScriptToken* add(size_t from, const ScriptToken& token)
+  { SharedLock lock(m_mutex); return &m_tokens.emplace(from, token)->second; }
+  
+  // Returns false if there was no compilation attempt at this position yet.
+  // Otherwise program is set to the result, null if the compilation failed.
+  bool findProgram(size_t from, shared_ptr<Bytecode>& program) const
+  {
+    auto it = m_programs.find(from);
+    if (it == m_programs.end()) {
+      return false;
+    }
+    program = it->second;
+    return true;
+  }
+  void addProgram(size_t from, const shared_ptr<Bytecode>& program)
+  { SharedLock lock(m_mutex); m_programs[from] = program; }
+  
+  // The headers of the canonical for-loops, keyed by the header start.
+  shared_ptr<ForLoop> findLoop(size_t from) const
+  {
+    auto it = m_loops.find(from);
+    return it == m_loops.end() ? nullptr : it->second;
+  }
+  void addLoop(size_t from, const shared_ptr<ForLoop>& loop)
+  { SharedLock lock(m_mutex); m_loops[from] = loop; }
+  
+  // Set for the bodies of custom functions: the tokens of the body are
+  // resolved to the local variable slots of the function.
+  void setSlots(const shared_ptr<const LocalSlots>& slots) { m_slots = slots; }
+  const LocalSlots* getSlots() const { return m_slots.get(); }
+  const shared_ptr<const LocalSlots>& getSharedSlots() const { return m_slots; }
+  
+private:
+  unordered_multimap<size_t, ScriptToken> m_tokens;
+  unordered_map<size_t, shared_ptr<Bytecode>> m_programs;
+  unordered_map<size_t, shared_ptr<ForLoop>> m_loops;
+  shared_ptr<const LocalSlots> m_slots;
+  
+  thread::id m_owner;
+  mutex      m_mutex; // the owner adding while another thread copies
+};
+
+// The lines of a script, filled in by Utils::convertToScript().
+struct LineIndex
+{
+  // The line number of the given position in the converted script,
+  // string::npos if not known.
+  size_t getLineNumber(size_t pos) const;
+  // The line of the original script, without the new line char.
+  string getLine(const string& original, size_t lineNumber) const;
+  
+  // The position of the last char of each line in the converted script,
+  // in the increasing order, and the number of this line in the original.
+  vector<pair<size_t, size_t>> char2Line;
+  // The start of every line in the original script.
+  vector<size_t> lineStarts;
+};
+
+// The text of a script together with where it came from. Never changed
+// after creation, so it is shared between all the copies of a script and
+// the scripts of the functions defined in it.
+struct ScriptSource
+{
+  string data;     // the script converted for parsing
+  string filename; // filename containing the script
+  
+  // Shared with the scripts of the functions defined in this script:
+  shared_ptr<const string> originalScript; // original raw script
+  shared_ptr<const LineIndex> lines;
+  
+  // Matching braces and parentheses of the data, see Utils::matchBraces().
+  // Empty for the temporary scripts: they are searched instead.
+  unordered_map<size_t, size_t> matches;
+};
+
 class ParsingScript
 {
 public:
   ParsingScript(const string& d, size_t f = 0) :
-    m_data(d), m_from(f) {}
-  
-  ParsingScript(const ParsingScript& other) :
-  m_data(other.m_data), m_from(other.m_from),
-  m_filename(other.m_filename), m_originalScript(other.m_originalScript),
-  m_scriptOffset(other.m_scriptOffset), m_char2Line(other.getChar2Line()) {}
+    m_from(f)
+  {
+    shared_ptr<ScriptSource> source = make_shared<ScriptSource>();
+    source->data = d;
+    setSource(source);
+  }
+  ParsingScript(const shared_ptr<const ScriptSource>& source, size_t f = 0) :
+    m_from(f) { setSource(source); }
   
-  inline size_t size() const           { return m_data.size(); }
-  inline bool stillValid() const       { return m_from < m_data.size(); }
+  inline size_t size() const           { return m_data->size(); }
+  inline bool stillValid() const       { return m_from < m_data->size(); }
   inline size_t getPointer() const     { return m_from; }
-  inline const string& getData() const { return m_data; }
+  inline const string& getData() const { return *m_data; }
   
   inline size_t find(char ch, size_t fromDelta = 0) const
-  { return m_data.find(ch, fromDelta); }
+  { return m_data->find(ch, fromDelta); }
   
   inline size_t find_first_of(const string& str, size_t fromDelta = 0) const
-  { return m_data.find_first_of(str, fromDelta); }
+  { return m_data->find_first_of(str, fromDelta); }
   
   inline string substr(size_t from, size_t len = string::npos) const
-  { return m_data.substr(from, len); }
+  { return m_data->substr(from, len); }
   
-  inline char operator()(size_t i) const { return m_data[i]; }
+  inline char operator()(size_t i) const { return (*m_data)[i]; }
   
-  inline char current() const     { return m_data[m_from]; }
-  inline char currentAndForward() { return m_data[m_from++]; }
+  inline char current() const     { return (*m_data)[m_from]; }
+  inline char currentAndForward() { return (*m_data)[m_from++]; }
   
-  inline char tryCurrent() const { return m_from < m_data.size() ?
-    m_data[m_from]   : Constants::NULL_CHAR; }
-  inline char tryNext() const    { return m_from+1 < m_data.size() ?
-    m_data[m_from+1] : Constants::NULL_CHAR; }
+  inline char tryCurrent() const { return m_from < m_data->size() ?
+    (*m_data)[m_from]   : Constants::NULL_CHAR; }
+  inline char tryNext() const    { return m_from+1 < m_data->size() ?
+    (*m_data)[m_from+1] : Constants::NULL_CHAR; }
   inline char tryPrev() const    { return m_from >= 1 ?
-    m_data[m_from-1] : Constants::NULL_CHAR; }
+    (*m_data)[m_from-1] : Constants::NULL_CHAR; }
   inline char tryPrevPrev() const    { return m_from >= 2 ?
-    m_data[m_from-2] : Constants::NULL_CHAR; }
+    (*m_data)[m_from-2] : Constants::NULL_CHAR; }
   
   inline string rest(size_t maxChars = Constants::MAX_CHARS_TO_SHOW) const
-  { return m_from < m_data.size() ?
-    m_data.substr(m_from, maxChars) : ""; }
+  { return m_from < m_data->size() ?
+    m_data->substr(m_from, maxChars) : ""; }
+  
+  inline const shared_ptr<const ScriptSource>& getSource() const { return m_source; }
+  inline void setSource(const shared_ptr<const ScriptSource>& source)
+  { m_source = source; m_data = &source->data; }
   
-  //inline void setChar2Line(const unordered_map<size_t, size_t>& char2Line) { m_char2Line = ptr; }
-  inline void setChar2Line(const unordered_map<size_t, size_t>& char2Line)
-  {
-    m_char2Line = char2Line;
-  }
-
-  inline unordered_map<size_t, size_t>& getChar2Line() const
-  {
-    return m_char2Line;
-  }
   inline void setOffset(size_t offset) { m_scriptOffset = offset; }
   
-  inline void setFilename(const string& filename) { m_filename = filename; }
-  inline const string& getFilename() const { return m_filename; }
+  inline const string& getFilename() const { return m_source->filename; }
+  
+  // Position of the '}' or ')' matching the '{' or '(' at pos,
+  // string::npos if it isn't known.
+  inline size_t findMatch(size_t pos) const
+  {
+    auto it = m_source->matches.find(pos);
+    return it == m_source->matches.end() ? string::npos : it->second;
+  }
   
-  inline void setOriginalScript(const string& script) { m_originalScript = script; }
-  inline const string& getOriginalScript() const { return m_originalScript; }
+  // Turns on caching of the extracted tokens and compiled programs. Used for
+  // scripts that are executed more than once, e.g. the main script or
+  // function bodies.
+  inline void initCache() { if (!m_cache) m_cache = make_shared<ScriptCache>(); }
+  inline void setCache(const shared_ptr<ScriptCache>& cache)
+  { m_cache = ScriptCache::forThread(cache); }
+  inline const shared_ptr<ScriptCache>& getCache() const { return m_cache; }
   
   inline void setPointer(size_t ptr)     { m_from = ptr; }
   inline void forward(size_t delta  = 1) { m_from += delta; }
@@ -83,20 +303,15 @@ public:
   
   string getOriginalLine(size_t& lineNumber) const;
   size_t getOriginalLineNumber() const;
- 
-  template <class K, class V>
-  static vector<K> getKeys(const unordered_map<K, V>& m);
 
 private:
-  string m_data; // contains the whole script
-  size_t m_from; // a pointer to the script
+  shared_ptr<const ScriptSource> m_source;
+  const string* m_data; // the whole script, m_source->data
+  size_t m_from;        // a pointer to the script
   
-  string m_filename;      // filename containing the script
-  string m_originalScript;// original raw script
   size_t m_scriptOffset = 0; // used in functiond defined in bigger scripts
-  mutable unordered_map<size_t, size_t> m_char2Line;
   
-  mutable unordered_map<size_t, size_t>* m_char2LinePtr = nullptr;
+  shared_ptr<ScriptCache> m_cache; // null if nothing is cached
 };
 
 
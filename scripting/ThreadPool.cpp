@@ -0,0 +1,278 @@
+//
+//  ThreadPool.cpp
+//  scripting
+//
+//  Created by Vassili Kaplan on 17/10/26.
+//  Copyright © 2026 Vassili Kaplan. All rights reserved.
+//
+
+#include "ThreadPool.h"
+
+#include "ParsingScript.h"
+#include "Utils.h"
+#include "UtilsOS.h"
+
+#include <system_error>
+#include <thread>
+
+void Task::run()
+{
+  try {
+    m_result = m_work();
+  } catch (exception& exc) {
+    m_error = exc.what();
+    m_failed = true;
+  }
+  m_work = nullptr;
+
+  lock_guard<mutex> lock(m_mutex);
+  m_done = true;
+  m_cv.notify_all();
+}
+
+bool Task::isDone()
+{
+  lock_guard<mutex> lock(m_mutex);
+  return m_done;
+}
+
+void Task::waitDone()
+{
+  unique_lock<mutex> lock(m_mutex);
+  while (!m_done) {
+    m_cv.wait(lock);
+  }
+}
+
+Variable Task::getResult() const
+{
+  if (m_failed) {
+    throw ParsingException(m_error);
+  }
+  return m_result;
+}
+
+void Channel::push(const Variable& value)
+{
+  m_items[(m_first + m_count) % m_items.size()] = value;
+  m_count++;
+  m_notEmpty.notify_one();
+}
+
+void Channel::pop(Variable& value)
+{
+  // Moved out, so that the slot doesn't keep the value alive.
+  value = move(m_items[m_first]);
+  m_items[m_first] = Variable::emptyInstance;
+  m_first = (m_first + 1) % m_items.size();
+  m_count--;
+  m_notFull.notify_one();
+}
+
+bool Channel::send(const Variable& value)
+{
+  unique_lock<mutex> lock(m_mutex);
+  if (m_count == m_items.size() && !m_closed) {
+    ThreadPool::Blocked blocked;
+    while (m_count == m_items.size() && !m_closed) {
+      m_notFull.wait(lock);
+    }
+  }
+  if (m_closed) {
+    return false;
+  }
+  push(value);
+  return true;
+}
+
+bool Channel::trySend(const Variable& value)
+{
+  lock_guard<mutex> lock(m_mutex);
+  if (m_count == m_items.size() || m_closed) {
+    return false;
+  }
+  push(value);
+  return true;
+}
+
+bool Channel::receive(Variable& value)
+{
+  unique_lock<mutex> lock(m_mutex);
+  if (m_count == 0 && !m_closed) {
+    ThreadPool::Blocked blocked;
+    while (m_count == 0 && !m_closed) {
+      m_notEmpty.wait(lock);
+    }
+  }
+  if (m_count == 0) {
+    return false;
+  }
+  pop(value);
+  return true;
+}
+
+bool Channel::tryReceive(Variable& value)
+{
+  lock_guard<mutex> lock(m_mutex);
+  if (m_count == 0) {
+    return false;
+  }
+  pop(value);
+  return true;
+}
+
+void Channel::close()
+{
+  lock_guard<mutex> lock(m_mutex);
+  m_closed = true;
+  m_notFull.notify_all();
+  m_notEmpty.notify_all();
+}
+
+bool Channel::isClosed()
+{
+  lock_guard<mutex> lock(m_mutex);
+  return m_closed;
+}
+
+size_t ThreadPool::size()
+{
+  static const size_t cores = max(thread::hardware_concurrency(), 1u);
+  return cores;
+}
+
+ThreadPool::Queue& ThreadPool::getQueue()
+{
+  // Never deleted: the workers may still wait on it when the program exits.
+  static Queue* queue = new Queue();
+  return *queue;
+}
+
+bool& ThreadPool::isWorker()
+{
+  static thread_local bool worker = false;
+  return worker;
+}
+
+shared_ptr<Task> ThreadPool::submit(const function<Variable()>& work)
+{
+  shared_ptr<Task> task = make_shared<Task>(work);
+
+  // The shared data is locked from now on, see SharedLock.
+  SharedLock::addThread();
+
+  Queue& queue = getQueue();
+  lock_guard<mutex> lock(queue.guard);
+  queue.tasks.push_back(task);
+  if (queue.idle > 0) {
+    queue.cv.notify_one();
+  } else {
+    startWorkerIfNeeded(queue);
+  }
+  return task;
+}
+
+void ThreadPool::startWorkerIfNeeded(Queue& queue)
+{
+  if (queue.tasks.empty() || queue.idle > 0 ||
+      queue.workers - queue.blocked >= size()) {
+    return;
+  }
+  // A worker runs scripts, so it gets a big stack, though not as big as
+  // the one of the main interpreter thread: the thread bodies are
+  // usually not as deep, and there is a worker per core. The nested
+  // calls allowed in a worker follow from its stack, see
+  // ParserFunction::addStackLevel().
+  if (OS::startThreadWithStackSize(Constants::WORKER_STACK_SIZE, work)) {
+    queue.workers++;
+    return;
+  }
+  try {
+    thread(work).detach();
+    queue.workers++;
+  } catch (system_error&) {
+    // The tasks wait for the workers there are.
+  }
+}
+
+void ThreadPool::work()
+{
+  isWorker() = true;
+
+  Queue& queue = getQueue();
+  unique_lock<mutex> lock(queue.guard);
+  while (true) {
+    // Too many workers after the blocked ones went on.
+    if (queue.workers - queue.blocked > size()) {
+      break;
+    }
+    if (queue.tasks.empty()) {
+      queue.idle++;
+      queue.cv.wait(lock);
+      queue.idle--;
+      continue;
+    }
+
+    shared_ptr<Task> task = queue.tasks.front();
+    queue.tasks.pop_front();
+    lock.unlock();
+
+    task->run();
+    SharedLock::removeThread();
+
+    lock.lock();
+  }
+  queue.workers--;
+}
+
+bool ThreadPool::runNext()
+{
+  Queue& queue = getQueue();
+  shared_ptr<Task> task;
+  {
+    lock_guard<mutex> lock(queue.guard);
+    if (queue.tasks.empty()) {
+      return false;
+    }
+    task = queue.tasks.front();
+    queue.tasks.pop_front();
+  }
+
+  task->run();
+  SharedLock::removeThread();
+  return true;
+}
+
+Variable ThreadPool::wait(Task& task)
+{
+  if (isWorker()) {
+    while (!task.isDone() && runNext()) {
+    }
+  }
+  if (!task.isDone()) {
+    Blocked blocked;
+    task.waitDone();
+  }
+  return task.getResult();
+}
+
+ThreadPool::Blocked::Blocked() : m_worker(isWorker())
+{
+  if (!m_worker) {
+    return;
+  }
+  Queue& queue = getQueue();
+  lock_guard<mutex> lock(queue.guard);
+  queue.blocked++;
+  startWorkerIfNeeded(queue);
+}
+
+ThreadPool::Blocked::~Blocked()
+{
+  if (!m_worker) {
+    return;
+  }
+  Queue& queue = getQueue();
+  lock_guard<mutex> lock(queue.guard);
+  queue.blocked--;
+}
@@ -0,0 +1,144 @@
+//
+//  ThreadPool.h
+//  scripting
+//
+//  Created by Vassili Kaplan on 17/10/26.
+//  Copyright © 2026 Vassili Kaplan. All rights reserved.
+//
+
+#ifndef ThreadPool_h
+#define ThreadPool_h
+
+#include "Constants.h"
+#include "Variable.h"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// A piece of work run by the ThreadPool, together with its result.
+class Task
+{
+public:
+  Task(const function<Variable()>& work) : m_work(work) {}
+
+  // Runs the work and wakes up the threads waiting for it.
+  void run();
+
+  bool isDone();
+  // Blocks until the work is done.
+  void waitDone();
+  // The result of the work, or its error thrown as a ParsingException.
+  // Can only be called when the work is done.
+  Variable getResult() const;
+
+private:
+  function<Variable()> m_work;
+  Variable             m_result;
+  string               m_error;
+  bool                 m_failed = false;
+
+  bool                 m_done = false;
+  mutex                m_mutex;
+  condition_variable   m_cv;
+};
+
+// A bounded queue of values between the script threads, see channel().
+// Any number of threads can send and receive. Sending waits while the
+// channel is full, so a producer can't get ahead of its consumers by
+// more than the capacity.
+class Channel
+{
+public:
+  Channel(size_t capacity) : m_items(max(capacity, (size_t)1)) {}
+  
+  // Waits for room for the value. Returns false if the channel is closed.
+  bool send(const Variable& value);
+  // Returns false if the channel is full or closed.
+  bool trySend(const Variable& value);
+  
+  // Waits for a value. Returns false when the channel is closed
+  // and all its values were received.
+  bool receive(Variable& value);
+  // Returns false if there is no value.
+  bool tryReceive(Variable& value);
+  
+  // Wakes up the threads waiting for the channel. The values sent
+  // before can still be received.
+  void close();
+  bool isClosed();
+  
+private:
+  // Called with the channel locked.
+  void push(const Variable& value);
+  void pop(Variable& value);
+  
+  vector<Variable>   m_items;     // a ring buffer
+  size_t             m_first = 0; // the oldest value
+  size_t             m_count = 0;
+  bool               m_closed = false;
+  
+  mutex              m_mutex;
+  condition_variable m_notFull;
+  condition_variable m_notEmpty;
+};
+
+// The workers running the script threads, see thread(). There are as many
+// of them as there are cores, started when they are needed for the first
+// time.
+//
+// If a worker blocks, e.g. waiting for another task, another worker is
+// started in its place as long as there is work left, so that the tasks
+// waiting for each other can't use up all the workers. The extra workers
+// quit when the blocked ones go on.
+class ThreadPool
+{
+public:
+
+  static shared_ptr<Task> submit(const function<Variable()>& work);
+
+  // Waits for the task and returns its result, or throws its error.
+  // A worker runs the other queued tasks meanwhile.
+  static Variable wait(Task& task);
+
+  // The number of the workers running at a time.
+  static size_t size();
+
+  // Marks the current worker as blocked while it exists.
+  // Does nothing in the threads other than the workers.
+  class Blocked
+  {
+  public:
+    Blocked();
+    ~Blocked();
+  private:
+    bool m_worker;
+  };
+
+private:
+
+  struct Queue
+  {
+    deque<shared_ptr<Task>> tasks;
+    mutex                   guard;
+    condition_variable      cv;
+
+    size_t workers = 0; // all of them, also the blocked ones
+    size_t blocked = 0;
+    size_t idle    = 0;
+  };
+
+  static void work();
+  // Runs the next queued task if there is one.
+  static bool runNext();
+  // Called with the queue locked.
+  static void startWorkerIfNeeded(Queue& queue);
+
+  static Queue& getQueue();
+  static bool& isWorker();
+};
+
+#endif /* ThreadPool_h */
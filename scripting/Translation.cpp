@@ -15,8 +15,9 @@ unordered_map<string, unordered_map<string, string>> Translation::s_dictionaries
 unordered_map<string, unordered_map<string, string>> Translation::s_errors;
 
 unordered_map<string, string> Translation::s_spellErrors;
-unordered_set<string> Translation::s_nativeWords;
-unordered_set<string> Translation::s_tempWords;
+unordered_set<int> Translation::s_nativeWords;
+unordered_set<int> Translation::s_tempWords;
+mutex Translation::s_mutex;
 
 string Translation::s_language;
 
@@ -77,15 +78,25 @@ unordered_map<string, string>& Translation::errorDictionary(const string& lang)
   return Translation::getDictionary(lang, s_dictionaries);
 }
 
-void Translation::addNativeKeyword(const string& word)
+void Translation::addNativeKeyword(int symbol)
 {
-  s_tempWords.insert(word);
-  addSpellError(word);
+  addTempKeyword(symbol);
 }
-void Translation::addTempKeyword(const string& word)
+void Translation::addTempKeyword(int symbol)
 {
-  s_tempWords.insert(word);
-  addSpellError(word);
+  // Called for every new variable: the words known to be added already
+  // are checked first without locking.
+  static thread_local unordered_set<int> added;
+  if (added.count(symbol) > 0) {
+    return;
+  }
+  
+  // The spell errors of a word are added once.
+  SharedLock lock(s_mutex);
+  if (s_tempWords.insert(symbol).second) {
+    addSpellError(Symbols::name(symbol));
+  }
+  added.insert(symbol);
 }
 
 void Translation::addSpellError(const string& word)
@@ -169,8 +180,8 @@ bool Translation::tryAddToSet(const string& originalName,
   for (typename T::const_iterator it = items.begin(); it != items.end(); ++it) {
     if (originalName.compare(*it) == 0) {
       items.insert(items.end(), translation);
-      s_nativeWords.insert(originalName);
-      s_nativeWords.insert(translation);
+      s_nativeWords.insert(Symbols::intern(originalName));
+      s_nativeWords.insert(Symbols::intern(translation));
       //cout << "Added [" << translation << "] to the ["
       //     << listName << "] list." << endl;
       return true;
@@ -288,7 +299,7 @@ void Translation::printScript(const string& script)
         rest.clear();
       }
       ParserFunction* func = ParserFunction::getFunction(item);
-      bool isNative = s_nativeWords.count(item) > 0;
+      bool isNative = s_nativeWords.count(Symbols::find(item)) > 0;
       if (func != nullptr || isNative) {
         OS::Color color;
         color = isNative || func->isNative() ? OS::Color::GREEN :
@@ -361,13 +372,18 @@ string Translation::tryFindError(const string& item, const ParsingScript& script
   }
   string candidate;
   size_t minSize = item.size() > 3 ? 2 : item.size() - 1;
+  SharedLock lock(s_mutex);
   
   for (size_t i = item.size() - 1; i >= minSize; i--) {
     candidate = item.substr(0, i);
-    if (s_nativeWords.count(candidate) > 0) {
+    int symbol = Symbols::find(candidate);
+    if (symbol == Symbols::NONE) {
+      continue;
+    }
+    if (s_nativeWords.count(symbol) > 0) {
       return candidate + " " + Constants::START_ARG;
     }
-    if (s_tempWords.count(candidate) > 0) {
+    if (s_tempWords.count(symbol) > 0) {
       return candidate;
     }
   }
@@ -384,6 +400,17 @@ void Translation::throwException(const ParsingScript& script,
                                  const string& excName1,
                                  const string& errorToken,
                                  const string& excName2)
+{
+  // The script is copied: it only refers to the shared script source.
+  throw ParsingException([=]() {
+    return getErrorMessage(script, excName1, errorToken, excName2);
+  });
+}
+
+string Translation::getErrorMessage(const ParsingScript& script,
+                                    const string& excName1,
+                                    const string& errorToken,
+                                    const string& excName2)
 {
   string msg = Translation::getErrorString(excName1);
   Utils::replace(msg, "{0}", errorToken);
@@ -413,6 +440,6 @@ void Translation::throwException(const ParsingScript& script,
     msg += script.getFilename().empty() ? Constants::NEW_LINE : " ";
     msg += lineMsg;
   }
-  throw ParsingException(msg);
+  return msg;
 }
 
@@ -52,8 +52,9 @@ public:
                             string& str);
   static void printScript(const string& script);
   
-  static void addNativeKeyword(const string& word);
-  static void addTempKeyword(const string& word);
+  // The words are interned, see Symbols.
+  static void addNativeKeyword(int symbol);
+  static void addTempKeyword(int symbol);
   
   static void addSpellError(const string& word);
 
@@ -64,10 +65,15 @@ public:
   static string getErrorString(const string& key);
   static string tryFindError(const string& item, const ParsingScript& script);
 
+  // The message is made only if the exception is looked at.
   static void throwException(const ParsingScript& script,
                              const string& excName1,
                              const string& errorToken = "",
                              const string& excName2 = "");
+  static string getErrorMessage(const ParsingScript& script,
+                                const string& excName1,
+                                const string& errorToken = "",
+                                const string& excName2 = "");
 private:
   
   static string s_language;
@@ -86,8 +92,9 @@ private:
   static unordered_map<string, unordered_map<string, string>> s_errors;
 
   static unordered_map<string, string> s_spellErrors;
-  static unordered_set<string> s_nativeWords;
-  static unordered_set<string> s_tempWords;
+  static unordered_set<int> s_nativeWords;
+  static unordered_set<int> s_tempWords;
+  static mutex s_mutex; // of the words, added to by the script threads
 };
 
 
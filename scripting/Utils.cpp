@@ -129,15 +129,14 @@ vector<Variable> Utils::getArgs(ParsingScript& script,
     return args;
   }
   
-  ParsingScript tempScript(script.getData(), script.getPointer());
-  string body = Utils::getBodyBetween(tempScript, start, end);
+  size_t bodyEnd = getBodyEnd(script, start, end);
   
-  while (script.getPointer() < tempScript.getPointer()) {
+  while (script.getPointer() < bodyEnd) {
     Variable item = Utils::getItem(script);
     args.push_back(item);
   }
   
-  if (script.getPointer() <= tempScript.getPointer()) {
+  if (script.getPointer() <= bodyEnd) {
     // Eat closing parenthesis, if there is one, but only if it closes
     // the current argument list, not one after it.
     moveForwardIf(script, Constants::END_ARG);
@@ -154,6 +153,19 @@ string Utils::getBodyBetween(ParsingScript& script, char open, char close)
   string result;
   int braces = 0;
   
+  size_t end = script.getPointer() > 0 && script.tryPrev() == open ?
+    script.findMatch(script.getPointer() - 1) : string::npos;
+  if (end != string::npos) {
+    // The same as below without the search: only the leading spaces
+    // are skipped and the pointer is left at the closing char.
+    size_t from = script.getPointer();
+    while (from < end && script(from) == ' ') {
+      from++;
+    }
+    script.setPointer(end);
+    return script.substr(from, end - from);
+  }
+  
   for (; script.stillValid(); script.forward())
   {
     char ch = script.current();
@@ -179,10 +191,47 @@ string Utils::getBodyBetween(ParsingScript& script, char open, char close)
   return result;
 }
 
-string Utils::findStartingToken(const string& data, const vector<string>& items)
+size_t Utils::getBodyEnd(const string& data, size_t from, char open, char close)
+{
+  // Same as getBodyBetween() but only looks for the closing char:
+  // returns its position or the end of the data.
+  int braces = 0;
+  
+  for (; from < data.size(); from++)
+  {
+    char ch = data[from];
+    if (ch == open) {
+      braces++;
+    } else if (ch == close) {
+      braces--;
+    }
+    
+    if (braces == -1) {
+      break;
+    }
+  }
+  
+  return from;
+}
+
+size_t Utils::getBodyEnd(const ParsingScript& script, char open, char close)
+{
+  // If the body starts right after the opening char, its end is known.
+  size_t from = script.getPointer();
+  if (from > 0 && script.tryPrev() == open) {
+    size_t end = script.findMatch(from - 1);
+    if (end != string::npos) {
+      return end;
+    }
+  }
+  return getBodyEnd(script.getData(), from, open, close);
+}
+
+string Utils::findStartingToken(const string& data, const vector<string>& items,
+                                size_t from)
 {
   for (size_t i = 0; i < items.size(); i++)  {
-    if (Utils::startsWith(data, items[i])) {
+    if (Utils::startsWith(data, items[i], from)) {
       return items[i];
     }
   }
@@ -190,21 +239,21 @@ string Utils::findStartingToken(const string& data, const vector<string>& items)
   return Constants::EMPTY;
 }
 
-bool Utils::startsWith(const string& base, const string& item)
+bool Utils::startsWith(const string& base, const string& item, size_t from)
 {
   size_t n = item.size();
-  if (n > base.size()) {
+  if (from > base.size() || n > base.size() - from) {
     return false;
   }
   
-  int comp = strncmp(base.c_str(), item.c_str(), n);
+  int comp = strncmp(base.c_str() + from, item.c_str(), n);
   
   return comp == 0;
 }
 
-string Utils::isNotSign(const string& data)
+string Utils::isNotSign(const string& data, size_t from)
 {
-  return startsWith(data, Constants::NOT) ? Constants::NOT : Constants::EMPTY;
+  return startsWith(data, Constants::NOT, from) ? Constants::NOT : Constants::EMPTY;
 }
 
 
@@ -218,15 +267,44 @@ bool Utils::contains(const string& base, char ch)
   return base.find(ch) != string::npos;
 }
 
-string Utils::getValidAction(const ParsingScript& script)
+const string& Utils::getValidAction(const ParsingScript& script)
 {
   if (!script.stillValid()) {
     return Constants::EMPTY;
   }
   
-  string base = script.rest(string::npos);
-  string action = findStartingToken(base, Constants::ACTIONS);
-  return action;
+  return getValidAction(script.getData(), script.getPointer());
+}
+
+const string& Utils::getValidAction(const string& data, size_t from)
+{
+  // All actions grouped by their first char, the longest ones first.
+  static const vector<vector<const string*>> actionsByChar = []() {
+    vector<vector<const string*>> table(256);
+    for (const string& action : Constants::ACTIONS) {
+      table[(unsigned char)action[0]].push_back(&action);
+    }
+    for (vector<const string*>& actions : table) {
+      stable_sort(actions.begin(), actions.end(),
+                  [](const string* a, const string* b) { return a->size() > b->size(); });
+    }
+    return table;
+  }();
+  
+  // Looks at the actions in place, without copying the rest of the script.
+  if (from >= data.size()) {
+    return Constants::EMPTY;
+  }
+  
+  const vector<const string*>& candidates = actionsByChar[(unsigned char)data[from]];
+  for (const string* action : candidates) {
+    if (action->size() == 1 ||
+        data.compare(from, action->size(), *action) == 0) {
+      return *action;
+    }
+  }
+  
+  return Constants::EMPTY;
 }
 
 bool Utils::moveForwardIf(ParsingScript& script, char expected,
@@ -648,9 +726,42 @@ void Utils::checkSpecialChars(string const& str)
   }
 }
 
-string Utils::convertToScript(const string& source, unordered_map<size_t, size_t>& char2Line)
+void Utils::matchBraces(const string& data, unordered_map<size_t, size_t>& matches)
+{
+  // Like the scans in getBodyEnd() and Interpreter::skipBlock(), the
+  // quotes aren't taken into account: any brace counts.
+  vector<size_t> groups;
+  vector<size_t> args;
+  
+  for (size_t i = 0; i < data.size(); i++) {
+    switch (data[i])
+    {
+      case Constants::START_GROUP:
+        groups.push_back(i);
+        break;
+      case Constants::START_ARG:
+        args.push_back(i);
+        break;
+      case Constants::END_GROUP:
+        if (!groups.empty()) {
+          matches[groups.back()] = i;
+          groups.pop_back();
+        }
+        break;
+      case Constants::END_ARG:
+        if (!args.empty()) {
+          matches[args.back()] = i;
+          args.pop_back();
+        }
+        break;
+    }
+  }
+}
+
+string Utils::convertToScript(const string& source, LineIndex& lines)
 {
   string result;
+  lines.lineStarts.push_back(0);
   
   bool inQuotes       = false;
   bool spaceOK        = false;
@@ -672,10 +783,11 @@ string Utils::convertToScript(const string& source, unordered_map<size_t, size_t
     
     if (ch == '\n') {
       if (result.size() > lastScriptLength) {
-        char2Line[result.size() - 1] = lineNumber;
+        lines.char2Line.emplace_back(result.size() - 1, lineNumber);
         lastScriptLength = result.size();
       }
       lineNumber++;
+      lines.lineStarts.push_back(i + 1);
     }
 
     if (inComments && ((simpleComments && ch != '\n') ||
@@ -14,6 +14,7 @@
 #include "Variable.h"
 
 #include <algorithm>
+#include <functional>
 #include <memory>
 
 class  ParsingException : public exception
@@ -21,30 +22,46 @@ class  ParsingException : public exception
 public:
   ParsingException(const string& err) :
   exception(), m_what(err) {}
+  // The message is made by format() when it is read for the first time.
+  // Used for the messages that are expensive to make, since many of the
+  // exceptions are caught without looking at them.
+  ParsingException(const function<string()>& format) :
+  exception(), m_format(format) {}
   ParsingException() throw() {};
-  const char* what()  const throw() { return m_what.c_str(); }
-  const string& msg() const throw() { return m_what; }
+  const char* what()  const throw() { return msg().c_str(); }
+  const string& msg() const
+  {
+    if (m_format) {
+      m_what = m_format();
+      m_format = nullptr;
+    }
+    return m_what;
+  }
+  bool empty() const { return !m_format && m_what.empty(); }
 private:
-  string m_what;
+  mutable string m_what;
+  mutable function<string()> m_format;
 };
 
 class Utils
 {
 public:
   
-  static string findStartingToken(const string& data, const vector<string>& items);
-  static bool startsWith(const string& base, const string& item);
+  static string findStartingToken(const string& data, const vector<string>& items,
+                                  size_t from = 0);
+  static bool startsWith(const string& base, const string& item, size_t from = 0);
   
   static bool contains(const string& base, const string& item);
   static bool contains(const string& base, char ch);
   
-  static string getValidAction(const ParsingScript& script);
+  static const string& getValidAction(const ParsingScript& script);
+  static const string& getValidAction(const string& data, size_t from);
   
   static bool moveForwardIf(ParsingScript& script, char expected,
                             char expected2 = Constants::NULL_CHAR);
   
   static bool moveBackIf(ParsingScript& script, char notExpected);
-  static string isNotSign(const string& data);
+  static string isNotSign(const string& data, size_t from = 0);
   
   static bool toBool(double value);
   
@@ -77,8 +94,12 @@ public:
   static bool keepSpace(const string& script, char next);
   static bool keepSpaceOnce(const string& script, char next);
 
-  static string convertToScript(const string& source,
-                                unordered_map<size_t, size_t>& char2Line);
+  static string convertToScript(const string& source, LineIndex& lines);
+  // Maps the position of every '{' and '(' in the converted script to the
+  // position of the matching '}' or ')', so that the blocks and the
+  // argument lists can be skipped without scanning them again.
+  static void matchBraces(const string& data,
+                          unordered_map<size_t, size_t>& matches);
   
   // Checks whether there is an argument separator (e.g.  ',') before the end of the
   // function call. E.g. returns true for "a,b)" and "a(b,c),d)" and false for "b),c".
@@ -95,6 +116,10 @@ public:
                                   char start, char end, bool& isList);
   static string getBodyBetween(ParsingScript& script,
                                char open, char close);
+  static size_t getBodyEnd(const string& data, size_t from,
+                           char open, char close);
+  static size_t getBodyEnd(const ParsingScript& script,
+                           char open, char close);
   
   static void skipRestExpr(ParsingScript& script);
   
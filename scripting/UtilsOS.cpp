@@ -44,8 +44,10 @@ const string OS::DIR_SEP = "\\";
 #include <curses.h>
 #include <dirent.h>
 #include <grp.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -1436,6 +1438,120 @@ double OS::getCpuTime()
   return result;
 }
 
+// 0 until known.
+static size_t& threadStackSize()
+{
+  static thread_local size_t stackSize = 0;
+  return stackSize;
+}
+
+// Owned by the thread running it.
+struct StackWork
+{
+  size_t stackSize;
+  function<void()> work;
+};
+
+#ifdef _WIN32
+static DWORD WINAPI runWork(LPVOID data)
+{
+  unique_ptr<StackWork> stackWork(static_cast<StackWork*>(data));
+  threadStackSize() = stackWork->stackSize;
+  stackWork->work();
+  return 0;
+}
+#else
+static void* runWork(void* data)
+{
+  unique_ptr<StackWork> stackWork(static_cast<StackWork*>(data));
+  threadStackSize() = stackWork->stackSize;
+  stackWork->work();
+  return nullptr;
+}
+#endif
+
+// Starts a thread running the work, and waits for it to finish if join
+// is set. Returns false if the thread can't be started.
+static bool startThread(size_t stackSize, const function<void()>& work, bool join)
+{
+  StackWork* stackWork = new StackWork{stackSize, work};
+#ifdef _WIN32
+  HANDLE thread = CreateThread(NULL, stackSize, runWork, (LPVOID)stackWork,
+                               STACK_SIZE_PARAM_IS_A_RESERVATION, NULL);
+  if (thread == NULL) {
+    delete stackWork;
+    return false;
+  }
+  if (join) {
+    WaitForSingleObject(thread, INFINITE);
+  }
+  CloseHandle(thread);
+#else
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_t thread;
+  bool started = pthread_attr_setstacksize(&attr, stackSize) == 0 &&
+                 (join || pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) == 0) &&
+                 pthread_create(&thread, &attr, runWork, (void*)stackWork) == 0;
+  pthread_attr_destroy(&attr);
+  if (!started) {
+    delete stackWork;
+    return false;
+  }
+  if (join) {
+    pthread_join(thread, nullptr);
+  }
+#endif
+  return true;
+}
+
+void OS::runWithStackSize(size_t stackSize, const function<void()>& work)
+{
+  // If there is no thread with a big enough stack, the work still runs,
+  // with less nested calls allowed, see getStackSize().
+  if (!startThread(stackSize, work, true)) {
+    work();
+  }
+}
+
+bool OS::startThreadWithStackSize(size_t stackSize, const function<void()>& work)
+{
+  return startThread(stackSize, work, false);
+}
+
+size_t OS::getStackSize()
+{
+  size_t& stackSize = threadStackSize();
+  if (stackSize == 0) {
+    stackSize = getDefaultStackSize();
+  }
+  return stackSize;
+}
+
+size_t OS::getDefaultStackSize()
+{
+#ifdef _WIN32
+  return 1 << 20; // the default of the linker
+#else
+  // The smaller of the defaults of the main thread and of the other ones,
+  // since it isn't known which one this is.
+  size_t stackSize = 8 << 20;
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_STACK, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+    stackSize = min(stackSize, (size_t)limit.rlim_cur);
+  }
+  pthread_attr_t attr;
+  size_t threadSize = 0;
+  if (pthread_attr_init(&attr) == 0) {
+    if (pthread_attr_getstacksize(&attr, &threadSize) == 0 && threadSize > 0) {
+      stackSize = min(stackSize, threadSize);
+    }
+    pthread_attr_destroy(&attr);
+  }
+  return stackSize;
+#endif
+}
+
 bool OS::match(const string& str, const string& contains,
                const string& exact, const string& startsWith,
                const string& endsWith)
@@ -146,6 +146,20 @@ public:
   static void showCursor(bool show);
   
   static double getCpuTime();
+  
+  // Runs work on a new thread with the given stack size and waits for it,
+  // or runs it right here if such a thread can't be started.
+  // The work must not throw.
+  static void runWithStackSize(size_t stackSize, const function<void()>& work);
+  // Starts work on a new detached thread with the given stack size.
+  // Returns false if the thread can't be started.
+  static bool startThreadWithStackSize(size_t stackSize, const function<void()>& work);
+  // The stack size of the current thread: the one it was started with by
+  // runWithStackSize(), or else the default one of the system.
+  static size_t getStackSize();
+  
+private:
+  static size_t getDefaultStackSize();
 };
 
 class SignalHandler;
@@ -11,28 +11,80 @@
 #include "Variable.h"
 
 Variable Variable::emptyInstance;
+const Variable::Data Variable::emptyData;
+
+Variable& Variable::operator=(const Variable& other)
+{
+    retain(other.data);
+    release(data);
+    numValue = other.numValue;
+    type     = other.type;
+    isReturn = other.isReturn;
+    data     = other.data;
+    return *this;
+}
+
+Variable& Variable::operator=(Variable&& other)
+{
+    if (this != &other) {
+        release(data);
+        numValue = other.numValue;
+        type     = other.type;
+        isReturn = other.isReturn;
+        data     = other.data;
+        other.data = nullptr;
+    }
+    return *this;
+}
 
 Variable Variable::duplicate(const Variable* other)
 {
-    Variable copy;
-    copy.numValue   = other->numValue;
-    copy.strValue   = other->strValue;
-    copy.tuple      = other->tuple;
-    copy.dictionary = other->dictionary;
-    copy.action     = other->action;
-    copy.varname    = other->varname;
-    copy.type       = other->type;
-    
+    Variable copy(*other);
+    copy.isReturn = false;
     return copy;
 }
 
+void Variable::set(const string& str)
+{
+    Data* strData = new Data();
+    strData->strValue = str;
+    release(data);
+    data = strData;
+    type = Constants::STRING;
+}
+
+void Variable::set(const vector<Variable>& t)
+{
+    Data* tupleData = new Data();
+    tupleData->tuple = t;
+    release(data);
+    data = tupleData;
+    type = Constants::ARRAY;
+}
+
+Variable::Data& Variable::updateData()
+{
+    if (data == nullptr) {
+        data = new Data();
+    } else if (data->refs.load(memory_order_acquire) > 1) {
+        // Shared with another copy: this one is changed from now on.
+        Data* copy = new Data();
+        copy->strValue   = data->strValue;
+        copy->tuple      = data->tuple;
+        copy->dictionary = data->dictionary;
+        release(data);
+        data = copy;
+    }
+    return *data;
+}
+
 string Variable::toString() const
 {
     if (type == Constants::NONE) {
         return "";
     }
     if (type == Constants::STRING) {
-        return strValue;
+        return getString();
     }
     if (type == Constants::NUMBER) {
         return Utils::isInt(numValue) ?
@@ -41,6 +93,7 @@ string Variable::toString() const
     }
    
     // Otherwise this is a tuple
+    const vector<Variable>& tuple = getTuple();
     string result = "{ ";
     for (size_t i = 0; i < tuple.size(); i++) {
         result += "[" + tuple[i].toString() + "] ";
@@ -56,6 +109,7 @@ string Variable::toPrint() const
         return toString();
     }
     
+    const vector<Variable>& tuple = getTuple();
     string result = "";
     for (size_t i = 0; i < tuple.size(); i++) {
         result += tuple[i].toString() +
@@ -72,14 +126,28 @@ Variable& Variable::getValue(size_t index)
                            "] but " + to_string(index) + " requested.");
   }
   if (type == Constants::ARRAY) {
-    return tuple[index];
+    return updateTuple()[index];
+  }
+  return *this;
+}
+
+const Variable& Variable::getValue(size_t index) const
+{
+  if (index >= totalElements()) {
+    throw ParsingException("There are only [" + to_string(totalElements()) +
+                           "] but " + to_string(index) + " requested.");
+  }
+  if (type == Constants::ARRAY) {
+    return getTuple()[index];
   }
   return *this;
 }
 
 size_t Variable::set(const string& hash, const Variable& var)
 {
-  auto it = dictionary.insert({hash, tuple.size()});
+  Data& elems = updateData();
+  vector<Variable>& tuple = elems.tuple;
+  auto it = elems.dictionary.insert({hash, tuple.size()});
   if (it.second) {
     // Inserted as a new element.
     tuple.emplace_back(var);
@@ -101,167 +169,150 @@ size_t Variable::set(const string& hash, const Variable& var)
 
 const Variable& Variable::get(const string& hash) const
 {
-    auto it = dictionary.find(hash);
-    size_t ptr = it == dictionary.end() ?
+    const Data& elems = getData();
+    auto it = elems.dictionary.find(hash);
+    size_t ptr = it == elems.dictionary.end() ?
         string::npos : it->second;
     
-    if (ptr == string::npos || ptr >= tuple.size()) {
+    if (ptr == string::npos || ptr >= elems.tuple.size()) {
         throw ParsingException("Element [" + hash +
                                "] doesn't exist");
     }
  
-    return tuple[ptr];
+    return elems.tuple[ptr];
 }
 
 bool Variable::tryGet(const string& hash, Variable& var)
 {
-    auto it = dictionary.find(hash);
-    size_t ptr = it == dictionary.end() ?
+    const Data& elems = getData();
+    auto it = elems.dictionary.find(hash);
+    size_t ptr = it == elems.dictionary.end() ?
         string::npos : it->second;
 
-    if (ptr == string::npos || ptr >= tuple.size()) {
+    if (ptr == string::npos || ptr >= elems.tuple.size()) {
         return false;
     }
     
-    var = tuple[ptr];
+    var = elems.tuple[ptr];
     return true;
 }
 
 size_t Variable::getArrayIndex(const Variable& indexVar) const
 {
+    const Data& elems = getData();
     if (indexVar.type == Constants::NUMBER) {
         Utils::checkNonNegInteger(indexVar);
         return indexVar.numValue;
     }
     string hash = indexVar.toString();
-    auto it = dictionary.find(hash);
+    auto it = elems.dictionary.find(hash);
 
-    return it == dictionary.end() ?
+    return it == elems.dictionary.end() ?
              string::npos : it->second;
 }
 
 bool Variable::exists(const string& hash) const
 {
-    auto it = dictionary.find(hash);
-    return it != dictionary.end();
+    const Data& elems = getData();
+    auto it = elems.dictionary.find(hash);
+    return it != elems.dictionary.end();
 }
 
 bool Variable::exists(const Variable& indexVar, bool notEmpty) const
 {
+    const Data& elems = getData();
     if (indexVar.type == Constants::NUMBER) {
         if (indexVar.numValue < 0 ||
-            indexVar.numValue >= tuple.size() ||
+            indexVar.numValue >= elems.tuple.size() ||
             indexVar.numValue - floor(indexVar.numValue) != 0.0) {
             return false;
         }
         if (notEmpty) {
-          return tuple[(int)indexVar.numValue].getType() != Constants::NONE;
+          return elems.tuple[(int)indexVar.numValue].getType() != Constants::NONE;
         }
         return true;
     }
     
     string hash = indexVar.toString();
-    auto it = dictionary.find(hash);
-    return it != dictionary.end();
+    auto it = elems.dictionary.find(hash);
+    return it != elems.dictionary.end();
 }
 
-bool Variable::canMergeWith(const Variable& right)
+void Variable::merge(const Variable& right, Constants::Operator op)
 {
-    return getPriority(action) >= getPriority(right.getAction());
-}
-
-int Variable::getPriority(const string& action)
-{
-    unordered_map<string, int>::const_iterator it =
-        Constants::PRIORITY.find(action);
-    
-    if (it == Constants::PRIORITY.end()) {
-        return 0;
+    if (type == Constants::STRING ||
+        right.getType() == Constants::STRING) {
+        mergeStrings(right, op);
+    } else {
+        mergeNumbers(right, op);
     }
-    
-    return it->second;
 }
 
-void Variable::merge(const Variable& right)
+void Variable::mergeNumbers(const Variable& right, Constants::Operator op)
 {
-    if (type == Constants::STRING ||
-        right.getType() == Constants::STRING) {
-        mergeStrings(right);
+    double result = mergeNumbers(numValue, right.numValue, op);
+    if (op >= Constants::LESS && op <= Constants::NOT_EQUAL) {
+        set(result); // A Boolean comparison
     } else {
-        mergeNumbers(right);
+        numValue = result;
     }
-    
-    action = right.action;
 }
 
-void Variable::mergeNumbers(const Variable& right)
+double Variable::mergeNumbers(double left, double right,
+                              Constants::Operator op)
 {
-    double tryBool = mergeBool(numValue, right.numValue, action);
-    if (tryBool >= 0) {
-        set(tryBool);
-        return;
-    }
-    
-    if (action.compare("+") == 0) {
-        numValue += right.numValue;
-    } else if (action.compare("-") == 0) {
-        numValue -= right.numValue;
-    } else if (action.compare("*") == 0) {
-        numValue *= right.numValue;
-    } else if (action.compare("/") == 0) {
-        numValue /= right.numValue;
-    } else if (action.compare("^") == 0) {
-        numValue = pow(numValue, right.numValue);
-    } else if (action.compare("%") == 0) {
-        numValue = (int)numValue % (int)right.numValue;
-    } else if (action.compare("&&") == 0) {
-        numValue = numValue && right.numValue;
-    } else if (action.compare("||") == 0) {
-        numValue = numValue || right.numValue;
-    /*} else {
-        throw ParsingException("Unknown action [" + action +
-                               "] for numbers");*/
+    switch (op) {
+        case Constants::PLUS:          return left + right;
+        case Constants::MINUS:         return left - right;
+        case Constants::MULTIPLY:      return left * right;
+        case Constants::DIVIDE:        return left / right;
+        case Constants::MODULO:        return (int)left % (int)right;
+        case Constants::POWER:         return pow(left, right);
+        case Constants::LESS:          return left < right;
+        case Constants::GREATER:       return left > right;
+        case Constants::LESS_EQUAL:    return left <= right;
+        case Constants::GREATER_EQUAL: return left >= right;
+        case Constants::EQUAL:         return left == right;
+        case Constants::NOT_EQUAL:     return left != right;
+        case Constants::AND:           return left && right;
+        case Constants::OR:            return left || right;
+        default:                       return left;
     }
 }
 
-void Variable::mergeStrings(const Variable& right)
+void Variable::mergeStrings(const Variable& right, Constants::Operator op)
 {
     string arg1 = toString();
     string arg2 = right.toString();
     
-    double tryBool = mergeBool(arg1, arg2, action);
+    double tryBool = mergeBool(arg1, arg2, op);
     if (tryBool >= 0) {
         // A Boolean comparison succeeded
         set(tryBool);
         return;
     }
     
-    if (action.compare("+") == 0) {
+    if (op == Constants::PLUS) {
         set(arg1 + arg2);
         return;
     }
     
-    throw ParsingException("Unknown action [" + action +
+    throw ParsingException("Unknown action [" +
+                           Constants::operatorToString(op) +
                            "] for strings");
 }
 
 template <class T>
 double Variable::mergeBool(const T& arg1, const T& arg2,
-                           const string& action)
+                           Constants::Operator op)
 {
-    if (action.compare(">") == 0) {
-        return arg1 > arg2;
-    } else if (action.compare("<") == 0) {
-        return arg1 < arg2;
-    } else if (action.compare(">=") == 0) {
-        return arg1 >= arg2;
-    } else if (action.compare("<=") == 0) {
-        return arg1 <= arg2;
-    } else if (action.compare("==") == 0) {
-        return arg1 == arg2;
-    } else if (action.compare("!=") == 0) {
-        return arg1 != arg2;
+    switch (op) {
+        case Constants::GREATER:       return arg1 > arg2;
+        case Constants::LESS:          return arg1 < arg2;
+        case Constants::GREATER_EQUAL: return arg1 >= arg2;
+        case Constants::LESS_EQUAL:    return arg1 <= arg2;
+        case Constants::EQUAL:         return arg1 == arg2;
+        case Constants::NOT_EQUAL:     return arg1 != arg2;
+        default:                       return -1.0;
     }
-    
-    return -1.0;
 }
@@ -11,29 +11,43 @@
 
 #include "Constants.h"
 
+#include <atomic>
+
 class Parser;
 
+// A value of a CSCS variable or of an expression. Only the number is kept
+// inline: the string, the array elements and the dictionary are in a
+// separate, reference counted Data, so that a Variable stays small
+// and copying it, even a large array, is cheap.
 class Variable
 {
 public:
-    Variable() :
-        type(Constants::NONE) {}
+    Variable() {}
     Variable(double val) :
         numValue(val), type(Constants::NUMBER) {}
-    Variable(string str) :
-        strValue(str), type(Constants::STRING) {}
-    Variable(vector<Variable> vec) :
-        tuple(vec),    type(Constants::ARRAY) {}
+    Variable(const string& str) {
+        set(str); }
+    Variable(const vector<Variable>& vec) {
+        set(vec); }
     Variable(Constants::Type tp) :
         type(tp) {}
     
-    virtual ~Variable() {}
+    Variable(const Variable& other) :
+        numValue(other.numValue), type(other.type),
+        isReturn(other.isReturn), data(other.data) { retain(data); }
+    Variable(Variable&& other) :
+        numValue(other.numValue), type(other.type),
+        isReturn(other.isReturn), data(other.data) { other.data = nullptr; }
+    ~Variable() { release(data); }
+    
+    Variable& operator=(const Variable& other);
+    Variable& operator=(Variable&& other);
     
     static Variable duplicate(const Variable* other);
     
-    void set(const string& str) { strValue = str; type = Constants::STRING; }
+    void set(const string& str);
     void set(const double& val) { numValue = val; type = Constants::NUMBER; }
-    void set(const vector<Variable>& t) { tuple = t; type = Constants::ARRAY; }
+    void set(const vector<Variable>& t);
 
     size_t set(const string& hash, const Variable& var);
     const Variable& get(const string& hash) const;
@@ -44,39 +58,102 @@ public:
     size_t getArrayIndex(const Variable& indexVar) const;
   
     size_t totalElements() const {
-      return type == Constants::ARRAY ? tuple.size() : 1;
+      return type == Constants::ARRAY ? getTuple().size() : 1;
     }
   
     Variable& getValue(size_t index);
+    const Variable& getValue(size_t index) const;
+  
+    // The string and the array elements are shared between the copies of
+    // a Variable. The first change through updateString() or updateTuple()
+    // makes a private copy if they are shared.
+    const string& getString() const;
+    string& updateString();
+    const vector<Variable>& getTuple() const;
+    vector<Variable>& updateTuple();
   
-    const string& getAction() const { return action; }
     Constants::Type getType() const { return type; }
 
     string toString() const;
     string toPrint()  const;
 
-    bool canMergeWith(const Variable& right);
-    void merge(const Variable& right);
+    void merge(const Variable& right, Constants::Operator op);
     
-    void mergeNumbers(const Variable& right);
-    void mergeStrings(const Variable& right);
+    void mergeNumbers(const Variable& right, Constants::Operator op);
+    void mergeStrings(const Variable& right, Constants::Operator op);
     
     static Variable emptyInstance;
     
-    static int getPriority(const string& action);
+    static double mergeNumbers(double left, double right,
+                               Constants::Operator op);
     
     template <class T> static double mergeBool(const T& arg1, const T& arg2,
-                                               const string& action);
+                                               Constants::Operator op);
 
     double numValue = 0.0;
+    Constants::Type type = Constants::NONE;
+    bool isReturn = false;
+
+private:
+  
+    struct Data;
+    Data* data = nullptr; // null if there is no string and no elements
+  
+    static void retain(Data* data);
+    static void release(Data* data);
+    const Data& getData() const;
+    Data& updateData();
+  
+    static const Data emptyData;
+};
+
+struct Variable::Data
+{
+    atomic<int> refs{1};
+    
     string strValue;
+    // The array elements and the positions of the string keys in them.
     vector<Variable> tuple;
     unordered_map<string, size_t> dictionary;
-    
-    string action;
-    string varname;
-    Constants::Type type = Constants::NONE;
-    bool isReturn = false;
 };
 
+inline void Variable::retain(Data* data)
+{
+    if (data != nullptr) {
+        data->refs.fetch_add(1, memory_order_relaxed);
+    }
+}
+
+inline void Variable::release(Data* data)
+{
+    if (data != nullptr && data->refs.fetch_sub(1, memory_order_acq_rel) == 1) {
+        delete data;
+    }
+}
+
+inline const Variable::Data& Variable::getData() const
+{
+    return data != nullptr ? *data : emptyData;
+}
+
+inline const string& Variable::getString() const
+{
+    return getData().strValue;
+}
+
+inline string& Variable::updateString()
+{
+    return updateData().strValue;
+}
+
+inline const vector<Variable>& Variable::getTuple() const
+{
+    return getData().tuple;
+}
+
+inline vector<Variable>& Variable::updateTuple()
+{
+    return updateData().tuple;
+}
+
 #endif /* Variable_h */
@@ -29,6 +29,21 @@ int main(int argc, char* argv[])
 {
   OS::init();
   
+  // Options start with "--", the rest are the positional arguments.
+  vector<string> args;
+  const string maxDepth = "--maxdepth=";
+  for (int i = 0; i < argc; i++) {
+    string arg = argv[i];
+    if (arg == "--vm") {
+      Interpreter::useBytecode(true);
+    } else if (arg.compare(0, maxDepth.size(), maxDepth) == 0) {
+      ParserFunction::setMaxStackLevels(strtoul(arg.c_str() + maxDepth.size(),
+                                                nullptr, 10));
+    } else {
+      args.push_back(arg);
+    }
+  }
+  
   try {
     Interpreter::init();
   }
@@ -41,16 +56,16 @@ int main(int argc, char* argv[])
   string file;
   file = "/Users/vk/Documents/github/cscscpp/bin/Debug/scripts/temp.cscs";
 
-  if (argc > 3 ) {
-    string script = Utils::getFileContents(argv[3]);
-    string result = Translation::translateScript(script, argv[1], argv[2]);
+  if (args.size() > 3 ) {
+    string script = Utils::getFileContents(args[3]);
+    string result = Translation::translateScript(script, args[1], args[2]);
     cout << result << endl;
     return 0;
   }
 
-  string path = argv[0];
-  if (argc > 1 ) {
-    file = argv[1];
+  string path = args[0];
+  if (args.size() > 1 ) {
+    file = args[1];
   }
   
   if (!file.empty()) {
@@ -72,15 +87,21 @@ int main(int argc, char* argv[])
 
 void processScript(const string& script)
 {
-  Variable result;
-  try {
-    result = Interpreter::process(script);
-    if (result.type != Constants::NONE) {
-      OS::print(result.toPrint(), true);
+  // The nested calls of the script are nested calls of the interpreter,
+  // so it gets a stack big enough for all of them allowed, see --maxdepth.
+  size_t stackSize = max((size_t)Constants::STACK_SIZE,
+                         ParserFunction::getMaxStackLevels() * Constants::STACK_PER_LEVEL);
+  OS::runWithStackSize(stackSize, [&]() {
+    Variable result;
+    try {
+      result = Interpreter::process(script);
+      if (result.type != Constants::NONE) {
+        OS::print(result.toPrint(), true);
+      }
+    } catch(exception& exc) {
+      OS::printError(exc.what(), true);
     }
-  } catch(exception& exc) {
-    OS::printError(exc.what(), true);
-  }
+  });
 }
 
 void splitByLast(const string& str, const string& sep, string& a, string& b)
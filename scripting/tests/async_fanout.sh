@@ -0,0 +1,28 @@
+#!/bin/sh
+# Runs async_fanout.cscs: each async() in a top-level loop gets the value
+# of the loop counter at the time of the call.
+#
+# Usage: async_fanout.sh [path to cscs]
+
+CSCS=${1:-./cscs}
+DIR=$(dirname "$0")
+
+OUT=$("$CSCS" "$DIR/async_fanout.cscs" 2>&1)
+STATUS=$?
+# Without the terminal escapes.
+OUT=$(printf '%s\n' "$OUT" | tr -d '\033' | sed 's/\[[0-9;?]*[a-zA-Z]//g')
+
+if [ $STATUS -ne 0 ]; then
+  echo "FAILED: cscs exited with $STATUS"
+  exit 1
+fi
+case "$OUT" in
+  *"squares=0,1,4,9"*)
+    echo "PASSED: async_fanout"
+    ;;
+  *)
+    echo "FAILED: unexpected output:"
+    echo "$OUT" | tail -4
+    exit 1
+    ;;
+esac
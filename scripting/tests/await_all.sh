@@ -0,0 +1,28 @@
+#!/bin/sh
+# Runs await_all.cscs: after await_all() fails on a bad handle, the good
+# handles given to it can still be awaited.
+#
+# Usage: await_all.sh [path to cscs]
+
+CSCS=${1:-./cscs}
+DIR=$(dirname "$0")
+
+OUT=$("$CSCS" "$DIR/await_all.cscs" 2>&1)
+STATUS=$?
+# Without the terminal escapes.
+OUT=$(printf '%s\n' "$OUT" | tr -d '\033' | sed 's/\[[0-9;?]*[a-zA-Z]//g')
+
+if [ $STATUS -ne 0 ]; then
+  echo "FAILED: cscs exited with $STATUS"
+  exit 1
+fi
+case "$OUT" in
+  *"Couldn't find thread [12345]"*"is given more than once"*"a=9 b=16"*)
+    echo "PASSED: await_all"
+    ;;
+  *)
+    echo "FAILED: unexpected output:"
+    echo "$OUT" | tail -4
+    exit 1
+    ;;
+esac
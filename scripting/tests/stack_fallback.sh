@@ -0,0 +1,29 @@
+#!/bin/sh
+# Runs deep_recursion.cscs with the address space limited below
+# Constants::STACK_SIZE, so that OS::runWithStackSize() can't start the
+# interpreter thread and runs the script on the default stack instead.
+# The recursion must then stop with the stack overflow error of the
+# interpreter rather than crash. Needs a system enforcing "ulimit -v".
+#
+# Usage: stack_fallback.sh [path to cscs]
+
+CSCS=${1:-./cscs}
+DIR=$(dirname "$0")
+
+OUT=$( (ulimit -v 500000 && "$CSCS" "$DIR/deep_recursion.cscs") 2>&1 )
+STATUS=$?
+
+if [ $STATUS -ne 0 ]; then
+  echo "FAILED: cscs exited with $STATUS"
+  exit 1
+fi
+case "$OUT" in
+  *"Stack overflow"*)
+    echo "PASSED: stack_fallback"
+    ;;
+  *)
+    echo "FAILED: expected a stack overflow error, got:"
+    echo "$OUT" | tail -3
+    exit 1
+    ;;
+esac